@@ -6,18 +6,45 @@ export type file = {
     path:string,
 }
 
+export type execOptions = {
+    env:{[string]:string}?,
+    cwd:string?,
+    stdin:string?,
+    sandbox:boolean?,
+    inputs:{string}?,
+    outputs:{string}?,
+    responseFile:boolean?,
+}
+
 export type task = {
     -- Instance vars
     name:string,
     -- Methods
     dependsOn:(task, ...string)->task,
     run:(task, (task)->nil)->task,
+    weight:(task, number)->task,
+    pool:(task, string)->task,
+    isolated:(task)->task,
 }
 
 return m :: {
-    runTask:(task, string)->nil,
+    runTask:(task, string)->boolean,
 
     task:(string)->task,
-    exec:(task, string)->nil,
+    getTask:(string)->task?,
+    exec:(task, string | {any}, execOptions?)->number,
     getFiles:(...string)->{file},
+    pool:(string, number)->nil,
+    setShared:(string, (string | number | boolean)?)->nil,
+    getShared:(string)->(string | number | boolean)?,
+
+    join:({string}, string?)->string,
+    prefix:(string | {string}, string)->string | {string},
+    replaceExtension:(string | {string}, string)->string | {string},
+    changeDir:(string | {string}, string)->string | {string},
+
+    isStale:(string | {string}, string | {string})->boolean,
+    mtime:(string)->number?,
+    prefetch:(string | {string})->nil,
+    invalidate:(string | {string} | nil)->nil,
 }
\ No newline at end of file
@@ -15,6 +15,20 @@ namespace LBUILD {
         LBUILD_O,
         LBUILD_BIN,
     } ;
+
+    enum LBUILD_TARGET_STATE {
+        LBUILD_TARGET_PENDING,
+        LBUILD_TARGET_RUNNING,
+        LBUILD_TARGET_DONE,
+        LBUILD_TARGET_FAILED,
+    };
+
+    enum LBUILD_RSP {
+        // Use a response file for oversized commands if the program is known to accept them
+        LBUILD_RSP_AUTO,
+        LBUILD_RSP_OFF,
+        LBUILD_RSP_ON,
+    };
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,62 @@
+#ifndef LBUILD_NINJA
+#define LBUILD_NINJA
+
+#include "lbuild_process.h"
+
+#include <string>
+
+using namespace std;
+
+namespace LBUILD {
+    /**
+     * Exports the evaluated task graph as a build.ninja
+     *
+     * While recording, the scheduler runs every task as usual but hands the commands of lbuild.exec to the writer
+     * instead of starting them and resumes the task with an exit code of 0. Each task becomes one ninja edge that runs
+     * its commands in order, so this only captures tasks whose callbacks don't depend on the results of their commands
+     *
+     * Every root task is recorded in its own pass over a freshly evaluated build script. A task recorded in several
+     * passes has to run the same commands in all of them, otherwise it read lua state another task changed
+     */
+    class NinjaWriter {
+        public:
+            /**
+             * Makes the scheduler record commands instead of running them
+             */
+            static void start_recording();
+            static bool is_recording();
+
+            /**
+             * Starts recording a dry run pass of root
+             */
+            static void begin_pass(string root);
+
+            /**
+             * Merges the tasks that ran in this pass into the graph, returning false after reporting the task if one of
+             * them ran different commands than in an earlier pass
+             */
+            static bool end_pass();
+
+            /**
+             * Appends spec to the commands of the given target
+             */
+            static void record_command(string target_name, const ProcessSpec& spec);
+
+            /**
+             * Records that target_name ran dep_name with lbuild.runTask, which becomes a dependency in the ninja file
+             */
+            static void record_edge(string target_name, string dep_name);
+
+            /**
+             * Writes the recorded graph to path along with an edge that regenerates it when script_path changes
+             *
+             * The file is left untouched if its content would not change. Returns false after reporting why if the
+             * graph can't be expressed in ninja
+             */
+            static bool write(string path, string script_path);
+
+            static void cleanup();
+    };
+}
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef LBUILD_PROC
+#define LBUILD_PROC
+
+#include "lbuild_args.h"
+
+#include <sys/types.h>
+
+#include <vector>
+#include <string>
+
+using namespace std;
+
+namespace LBUILD {
+    /**
+     * Everything needed to start a child process for lbuild.exec
+     */
+    struct ProcessSpec {
+        vector<string> argv;
+        // When set the child only sees env (as KEY=VALUE entries) instead of the environment of lbuild
+        bool replace_env = false;
+        vector<string> env;
+        // Working directory of the child, lbuild's own when empty
+        string cwd;
+        // File opened as the child's stdin, inherited when empty
+        string stdin_path;
+        // Runs the child in new user, mount, pid and network namespaces that only expose the system directories,
+        // inputs (read only) and outputs (read write) so undeclared dependencies fail
+        bool sandbox = false;
+        vector<string> inputs;
+        vector<string> outputs;
+        // Whether commands over the system's argument limit are passed to the program as an @file
+        LBUILD_RSP response_file = LBUILD_RSP_AUTO;
+
+        bool operator==(const ProcessSpec& other) const = default;
+    };
+
+    /**
+     * Returns how many bytes of arguments and environment a command can hand to execve
+     */
+    extern size_t command_limit();
+
+    /**
+     * Returns the longest single argument or environment entry execve accepts, counting its terminating null
+     */
+    extern size_t argument_limit();
+
+    /**
+     * Forks and execs the given process without waiting for it
+     *
+     * Commands too long for the system are written to a response file when the program accepts them.
+     * Returns the pid of the child or -1 if the process could not be started, after reporting why
+     */
+    extern pid_t spawn_process(const ProcessSpec& spec);
+
+    /**
+     * Returns a pidfd that becomes readable once the given child exits or -1 if the kernel does not support pidfds
+     */
+    extern int open_pidfd(pid_t pid);
+
+    /**
+     * Reaps the given child, storing its exit code in exit_code, and returns its response file to the pool
+     *
+     * Children killed by a signal report 128 + the signal number like most shells do.
+     * When block is false this returns false if the child is still running
+     */
+    extern bool reap_process(pid_t pid, bool block, int* exit_code);
+
+    /**
+     * Spawns the process and blocks until it exits, returning its exit code or -1 if it could not be started
+     */
+    extern int run_process(const ProcessSpec& spec);
+
+    /**
+     * Removes the directory sandboxed processes mount their root over and the response file pool
+     */
+    extern void cleanup_processes();
+}
+
+#endif
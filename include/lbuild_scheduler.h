@@ -0,0 +1,151 @@
+#ifndef LBUILD_SCHED
+#define LBUILD_SCHED
+
+#include "lbuild_args.h"
+#include "lbuild_target.h"
+#include "lbuild_process.h"
+#include "lua.h"
+
+#include <sys/types.h>
+
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <deque>
+#include <string>
+#include <memory>
+#include <future>
+
+using namespace std;
+
+namespace LBUILD {
+    /**
+     * A named limit on how much weight may be executing at once, e.g. to cap concurrent links
+     */
+    struct ResourcePool {
+        int capacity;
+        int in_use;
+    };
+
+    /**
+     * A command submitted by lbuild.exec that is either waiting for resources or executing
+     */
+    struct Job {
+        shared_ptr<BuildTarget> target;
+        ProcessSpec spec;
+        int weight;
+        string pool;
+        pid_t pid;
+        int pidfd;
+        // Set for commands from isolated tasks running on a worker, which wait on this instead of being resumed
+        shared_ptr<promise<int>> remote_result;
+    };
+
+    /**
+     * The scheduler drives BuildTarget::run for every target needed by a pass
+     *
+     * Run callbacks all share the one lua_State but each runs in its own thread. lbuild.exec and lbuild.runTask yield
+     * that thread back to the scheduler, which resumes it once the command exits or the task completes.
+     * Commands are started as long as their weight fits in both the global job budget and the pool of their task
+     */
+    class Scheduler {
+        private:
+            lua_State* l;
+            bool failed;
+            bool throttled;
+            int jobs_in_use;
+            // Isolated targets whose callback is running on a worker
+            int remote_running;
+
+            // Every target this pass has to run in the order they were discovered
+            vector<shared_ptr<BuildTarget>> scheduled;
+            unordered_set<BuildTarget*> scheduled_set;
+            // Targets whose run callback has yielded and is waiting on the scheduler
+            unordered_set<BuildTarget*> blocked;
+            // Targets that called runTask, keyed on the target they are waiting for
+            unordered_map<BuildTarget*, vector<shared_ptr<BuildTarget>>> waiters;
+            // The reverse of waiters, the target each runTask caller is waiting for
+            unordered_map<BuildTarget*, BuildTarget*> waiting_on;
+
+            deque<Job> queued;
+            vector<Job> running;
+
+            static unordered_map<string, ResourcePool> pools;
+            static int jobs;
+            static double memory_pressure_limit;
+            static Scheduler* active;
+
+            void schedule(shared_ptr<BuildTarget> target);
+            bool start_ready_targets();
+            void launch_jobs();
+            void wait_for_jobs();
+            void complete_job(Job& job, int exit_code);
+            void handle_resume(shared_ptr<BuildTarget> target, int status);
+            void finish_target(shared_ptr<BuildTarget> target, int status);
+            bool memory_pressure_high();
+            void handle_worker_messages();
+            bool waits_on(BuildTarget* from, BuildTarget* to);
+            void report_stuck_targets();
+        public:
+            Scheduler(lua_State* l);
+
+            /**
+             * Runs the given targets and everything they depend on, returning LUA_OK if all of them succeeded
+             */
+            int run(vector<shared_ptr<BuildTarget>> targets);
+
+            /**
+             * Queues a command for the given target. The caller must yield the target's thread afterwards
+             * and will be resumed with the exit code of the command
+             *
+             * Commands of isolated targets deliver their exit code to remote_result instead
+             */
+            void submit_job(shared_ptr<BuildTarget> target, ProcessSpec spec, shared_ptr<promise<int>> remote_result = NULL);
+
+            /**
+             * Makes waiter wait on target, scheduling target if it isn't already part of this pass
+             *
+             * Returns LBUILD_TARGET_DONE or LBUILD_TARGET_FAILED if target has already finished, otherwise the caller
+             * must yield the waiter's thread and will be resumed with a boolean for whether target succeeded
+             *
+             * Throws an invalid_argument exception if target is already waiting on waiter, directly or through other tasks
+             */
+            LBUILD_TARGET_STATE wait_target(shared_ptr<BuildTarget> waiter, shared_ptr<BuildTarget> target);
+
+            /**
+             * Tells the scheduler target gained dep as a dependency while this pass is running
+             *
+             * If target is part of this pass, dep and everything it depends on are scheduled as well
+             */
+            void add_dependency(shared_ptr<BuildTarget> target, shared_ptr<BuildTarget> dep);
+
+            /**
+             * Creates a resource pool, throwing an invalid_argument exception if one with that name already exists
+             */
+            static void add_pool(string name, int capacity);
+            static bool has_pool(string name);
+            static const unordered_map<string, ResourcePool>& get_pools();
+
+            /**
+             * Sets the global job budget, i.e. the total weight that may be executing at once
+             */
+            static void set_jobs(int jobs);
+            static int get_jobs();
+
+            /**
+             * Holds back new commands while the avg10 "some" value of /proc/pressure/memory is at or above limit
+             *
+             * A limit of 0 disables the check
+             */
+            static void set_memory_pressure_limit(double limit);
+
+            /**
+             * Returns the scheduler of the pass that is currently running, if any
+             */
+            static Scheduler* get_active();
+
+            static void cleanup();
+    };
+}
+
+#endif
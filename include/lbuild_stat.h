@@ -0,0 +1,54 @@
+#ifndef LBUILD_STAT
+#define LBUILD_STAT
+
+#include <stdint.h>
+
+#include <vector>
+#include <string>
+
+using namespace std;
+
+namespace LBUILD {
+    /**
+     * The parts of a stat result needed for up to date checks
+     */
+    struct FileStat {
+        bool exists;
+        bool is_dir;
+        int64_t mtime_ns;
+        uint64_t size;
+    };
+
+    /**
+     * A process wide cache of file stats keyed on interned, lexically normalised paths
+     *
+     * Entries stay valid until they are invalidated, which happens automatically for the declared outputs of
+     * commands run by lbuild.exec. Everything in here is safe to call from worker threads
+     */
+    class StatCache {
+        public:
+            /**
+             * Returns the stat of path, calling statx only if it isn't cached
+             */
+            static FileStat get(const string& path);
+
+            /**
+             * Returns the stat of a path by the id prefetch gave it, which skips looking the path up again
+             */
+            static FileStat get(uint32_t id);
+
+            /**
+             * Stats every uncached path at once, spreading the statx calls over the stat threads
+             *
+             * Returns the id of every path, in the same order
+             */
+            static vector<uint32_t> prefetch(const vector<string>& paths);
+
+            static void invalidate(const string& path);
+            static void invalidate_all();
+
+            static void cleanup();
+    };
+}
+
+#endif
@@ -18,6 +18,13 @@ namespace LBUILD {
         private:
             string target_name;
             vector<shared_ptr<BuildTarget>> dependencies;
+            int weight;
+            string pool;
+            bool isolated;
+            LBUILD_TARGET_STATE state;
+            // The lua thread the run callback executes in while this target is running
+            lua_State* thread;
+            int thread_ref;
             BuildTarget(string target_name);
         public:
             /**
@@ -45,8 +52,43 @@ namespace LBUILD {
             static unordered_map<std::string, std::shared_ptr<BuildTarget>> registered_targets;
 
 
+            /**
+             * Starts the run callback of this target in a new lua thread and returns the status of its first resume
+             * 
+             * A LUA_YIELD status means the callback is waiting on the scheduler and must be continued with resume
+             */
             int run(lua_State* l);
+
+            /**
+             * Continues a yielded run callback with the top nargs values of its thread as the results of the yielding call
+             */
+            int resume(int nargs);
+
+            /**
+             * Drops the reference to the lua thread once the run callback has finished
+             */
+            void release(lua_State* l);
+
             int add_dependency(string obj);
+
+            string get_name();
+            const vector<shared_ptr<BuildTarget>>& get_dependencies();
+            lua_State* get_thread();
+
+            LBUILD_TARGET_STATE get_state();
+            void set_state(LBUILD_TARGET_STATE state);
+
+            int get_weight();
+            void set_weight(int weight);
+
+            string get_pool();
+            void set_pool(string pool);
+
+            /**
+             * Isolated targets don't depend on lua state changed by other tasks, so their callback may run on a worker
+             */
+            bool is_isolated();
+            void set_isolated(bool isolated);
     };
 
     /**
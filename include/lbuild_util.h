@@ -7,8 +7,15 @@
 namespace LBUILD {
     extern void init_lua(lua_State* l);
     extern void cleanup();
+    /**
+     * Forgets the tasks, pools and shared values the build script registered so it can be evaluated again in a new lua_State
+     */
+    extern void reset_script();
 
     extern void setup_dependencies();
-    extern void run_task(lua_State* l, std::string task_name);
+    /**
+     * Runs the given task and everything it depends on, returning LUA_OK if they all succeeded
+     */
+    extern int run_task(lua_State* l, std::string task_name);
     extern void lua_stackDump(lua_State* l);
 }
\ No newline at end of file
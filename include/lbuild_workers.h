@@ -0,0 +1,93 @@
+#ifndef LBUILD_WORKERS
+#define LBUILD_WORKERS
+
+#include "lbuild_target.h"
+#include "lbuild_process.h"
+#include "lua.h"
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <memory>
+#include <future>
+
+using namespace std;
+
+namespace LBUILD {
+    enum LBUILD_WORKER_MSG {
+        // A worker wants to run a command for its task
+        LBUILD_WORKER_EXEC,
+        // A worker finished running the callback of its task
+        LBUILD_WORKER_DONE,
+    };
+
+    /**
+     * Sent from a worker thread to the scheduler
+     */
+    struct WorkerMessage {
+        LBUILD_WORKER_MSG kind;
+        shared_ptr<BuildTarget> target;
+        // LBUILD_WORKER_EXEC: the command and where to deliver its exit code
+        ProcessSpec spec;
+        shared_ptr<promise<int>> result;
+        // LBUILD_WORKER_DONE: the status of the callback and its error if it failed
+        int status;
+        string error;
+    };
+
+    /**
+     * Runs the callbacks of isolated tasks on worker threads that each own a lua_State
+     *
+     * Every worker state loads the cached bytecode of the build script as a replica: tasks are defined again so their
+     * callbacks exist, but nothing is registered with the build graph. Commands from worker callbacks are sent to the
+     * scheduler so they still count against the job budget and pools
+     */
+    class WorkerPool {
+        public:
+            static void set_worker_count(int count);
+            static int get_worker_count();
+
+            /**
+             * Returns true if isolated tasks should be handed to workers
+             */
+            static bool enabled();
+
+            /**
+             * Queues the callback of target on a worker, starting the workers the first time this is called
+             */
+            static void dispatch(shared_ptr<BuildTarget> target);
+
+            /**
+             * Returns an eventfd that becomes readable when workers have posted messages
+             */
+            static int get_event_fd();
+
+            /**
+             * Takes every message posted by the workers so far
+             */
+            static vector<WorkerMessage> drain();
+
+            /**
+             * Returns true on a worker thread, where the build script is only evaluated as a replica
+             */
+            static bool is_replica();
+
+            /**
+             * Returns true if l is the thread of the task callback currently running on this worker
+             */
+            static bool in_task(lua_State* l);
+
+            /**
+             * Hands a command from the running task callback to the scheduler.
+             * The caller must yield and is resumed with the exit code of the command
+             */
+            static void request_exec(ProcessSpec spec);
+
+            /**
+             * Stops and joins the worker threads
+             */
+            static void cleanup();
+    };
+}
+
+#endif
@@ -6,6 +6,16 @@
 
 namespace luau_exec {
     extern int luau_dofile(lua_State* L, char* file_dir);
+
+    /**
+     * Loads and runs already compiled bytecode
+     */
+    extern int luau_dobytecode(lua_State* L, const char* chunk_name, const std::string& bytecode);
+
+    /**
+     * Returns the bytecode of the last file run with luau_dofile
+     */
+    extern const std::string& luau_get_bytecode();
 }
 
 #endif
\ No newline at end of file
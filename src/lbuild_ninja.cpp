@@ -0,0 +1,487 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#include "lbuild_ninja.h"
+#include "lbuild_target.h"
+#include "lbuild_scheduler.h"
+#include "lbuild_process.h"
+
+using namespace LBUILD;
+using namespace std;
+
+// Outputs of tasks that don't declare any, never created so ninja runs them every time like lbuild does
+#define NINJA_STAMP_DIR ".lbuild"
+
+/**
+ * What the dry run passes saw of a task
+ */
+struct RecordedTask {
+    vector<ProcessSpec> commands;
+    set<string> deps;
+    string pool;
+    // The root task of the pass the commands were first recorded in
+    string root;
+};
+
+static bool recording = false;
+// Merged over every pass
+static map<string, RecordedTask> recorded;
+static map<string, int> recorded_pools;
+// Only the pass that is running
+static string pass_root;
+static unordered_map<string, vector<ProcessSpec>> pass_commands;
+static unordered_map<string, vector<string>> pass_edges;
+
+/**
+ * Quotes arg for /bin/sh, which ninja runs every command through
+ */
+static string shell_quote(const string& arg){
+    bool safe = !arg.empty();
+    for (char c : arg){
+        if (!isalnum((unsigned char) c) && string("_@%+=:,./-").find(c) == string::npos){
+            safe = false;
+            break;
+        }
+    }
+    if (safe){
+        return arg;
+    }
+
+    string res = "'";
+    for (char c : arg){
+        if (c == '\''){
+            res += "'\\''";
+        } else {
+            res += c;
+        }
+    }
+    res += "'";
+
+    return res;
+}
+
+/**
+ * Escapes value for the right hand side of a ninja variable, returning false if it can't be represented
+ */
+static bool escape_value(const string& value, string& out){
+    for (char c : value){
+        if (c == '\n'){
+            return false;
+        }
+        if (c == '$'){
+            out += '$';
+        }
+        out += c;
+    }
+
+    return true;
+}
+
+/**
+ * Escapes path for a build statement, returning false if it can't be represented
+ */
+static bool escape_path(const string& path, string& out){
+    for (char c : path){
+        if (c == '\n'){
+            return false;
+        }
+        if (c == '$' || c == ' ' || c == ':'){
+            out += '$';
+        }
+        out += c;
+    }
+
+    return true;
+}
+
+/**
+ * Turns a pool name into a ninja identifier that can't clash with the built in console pool
+ *
+ * Characters ninja doesn't allow in names, and _ itself, are written as _ followed by their hex code so different names stay different
+ */
+static string pool_name(const string& name){
+    static const char hex[] = "0123456789abcdef";
+    string res = "lbuild_";
+    for (char c : name){
+        if (isalnum((unsigned char) c) || c == '-' || c == '.'){
+            res += c;
+        } else {
+            res += '_';
+            res += hex[(unsigned char) c >> 4];
+            res += hex[(unsigned char) c & 0xf];
+        }
+    }
+
+    return res;
+}
+
+static string command_line(const ProcessSpec& spec){
+    string cmd;
+    if (spec.replace_env){
+        cmd += "env -i ";
+    } else if (!spec.env.empty()){
+        cmd += "env ";
+    }
+    for (const string& entry : spec.env){
+        cmd += shell_quote(entry) + " ";
+    }
+
+    for (size_t i = 0; i < spec.argv.size(); i++){
+        if (i > 0){cmd += " ";}
+        cmd += shell_quote(spec.argv.at(i));
+    }
+
+    // A subshell keeps the directory change from leaking into the next command of the task
+    if (!spec.cwd.empty()){
+        cmd = "(cd " + shell_quote(spec.cwd) + " && " + cmd + ")";
+    }
+    // lbuild opens stdin before changing directory, so the redirect has to stay outside the subshell
+    if (!spec.stdin_path.empty()){
+        cmd += " < " + shell_quote(spec.stdin_path);
+    }
+
+    return cmd;
+}
+
+/**
+ * Returns the number of bytes execve needs for the command's arguments and the variables it sets, or SIZE_MAX if one of them is over the per argument limit
+ */
+static size_t command_size(const ProcessSpec& spec){
+    size_t total = 0;
+    for (const vector<string>* list : {&spec.argv, &spec.env}){
+        for (const string& entry : *list){
+            if (entry.size() + 1 > argument_limit()){
+                return SIZE_MAX;
+            }
+            total += entry.size() + 1 + sizeof(char*);
+        }
+    }
+
+    return total;
+}
+
+/**
+ * Everything the writer needs to know about a task to emit its edge
+ */
+struct NinjaTask {
+    string pool;
+    vector<string> outputs;
+    vector<string> inputs;
+    vector<string> deps;
+    bool has_commands;
+};
+
+/**
+ * Returns true if the task only produces files, so depending on it can be a real dependency instead of order only
+ */
+static bool produces_files(const string& name, map<string, NinjaTask>& tasks, map<string, bool>& memo){
+    auto found = memo.find(name);
+    if (found != memo.end()){
+        return found->second;
+    }
+
+    auto found_task = tasks.find(name);
+    if (found_task == tasks.end()){
+        return false;
+    }
+    NinjaTask& task = found_task->second;
+    bool res;
+    if (task.has_commands){
+        res = !task.outputs.empty();
+    } else {
+        // Tasks without commands are aliases of their dependencies, and one without any is an empty phony that is always dirty
+        res = !task.deps.empty();
+        for (const string& dep : task.deps){
+            res = res && produces_files(dep, tasks, memo);
+        }
+    }
+    memo.insert_or_assign(name, res);
+
+    return res;
+}
+
+void NinjaWriter::start_recording(){
+    recording = true;
+}
+
+bool NinjaWriter::is_recording(){
+    return recording;
+}
+
+void NinjaWriter::begin_pass(string root){
+    pass_root = root;
+    pass_commands.clear();
+    pass_edges.clear();
+}
+
+void NinjaWriter::record_command(string target_name, const ProcessSpec& spec){
+    pass_commands[target_name].push_back(spec);
+}
+
+void NinjaWriter::record_edge(string target_name, string dep_name){
+    pass_edges[target_name].push_back(dep_name);
+}
+
+bool NinjaWriter::end_pass(){
+    for (auto &[name, target] : BuildTarget::registered_targets){
+        // Only tasks that ran in this pass have anything to compare
+        if (target->get_state() != LBUILD_TARGET_DONE){
+            continue;
+        }
+
+        vector<ProcessSpec>& specs = pass_commands[name];
+        auto it = recorded.find(name);
+        if (it == recorded.end()){
+            it = recorded.insert({name, RecordedTask{specs, {}, target->get_pool(), pass_root}}).first;
+        } else if (it->second.commands != specs){
+            fprintf(stderr, "[lbuild error] Task %s runs different commands when exported for %s and for %s, so it can't be a single ninja edge. "
+                "This happens when a task changes lua state other tasks read, e.g. by adding flags to a shared table\n",
+                name.c_str(), it->second.root.c_str(), pass_root.c_str());
+            return false;
+        }
+
+        for (auto dep : target->get_dependencies()){
+            it->second.deps.insert(dep->get_name());
+        }
+        for (const string& dep : pass_edges[name]){
+            it->second.deps.insert(dep);
+        }
+    }
+
+    for (auto &[name, pool] : Scheduler::get_pools()){
+        recorded_pools.insert_or_assign(name, pool.capacity);
+    }
+
+    return true;
+}
+
+bool NinjaWriter::write(string path, string script_path){
+    // Sorted so the same script always produces the same file
+    map<string, NinjaTask> tasks;
+    map<string, string> output_owners;
+    for (auto &[name, record] : recorded){
+        NinjaTask task{record.pool, {}, {}, {}, false};
+        task.deps.assign(record.deps.begin(), record.deps.end());
+
+        set<string> outputs;
+        set<string> inputs;
+        for (const ProcessSpec& spec : record.commands){
+            task.has_commands = true;
+            outputs.insert(spec.outputs.begin(), spec.outputs.end());
+            inputs.insert(spec.inputs.begin(), spec.inputs.end());
+        }
+        for (const string& output : outputs){
+            auto [owner, inserted] = output_owners.insert({output, name});
+            if (!inserted){
+                fprintf(stderr, "[lbuild error] Tasks %s and %s both declare %s as an output\n", owner->second.c_str(), name.c_str(), output.c_str());
+                return false;
+            }
+        }
+        task.outputs.assign(outputs.begin(), outputs.end());
+        // Files a task writes and then reads again are only outputs
+        for (const string& input : inputs){
+            if (outputs.count(input) == 0){
+                task.inputs.push_back(input);
+            }
+        }
+
+        tasks.insert_or_assign(name, move(task));
+    }
+
+    for (auto &[name, task] : tasks){
+        auto owner = output_owners.find(name);
+        if (owner != output_owners.end() && owner->second != name){
+            fprintf(stderr, "[lbuild error] Task %s has the same name as an output of task %s\n", name.c_str(), owner->second.c_str());
+            return false;
+        }
+    }
+
+    ostringstream out;
+    out << "# Generated by lbuild --emit-ninja from " << script_path << ", do not edit\n";
+    out << "ninja_required_version = 1.3\n";
+    out << "builddir = " << NINJA_STAMP_DIR << "\n\n";
+
+    // Ninja pools count edges rather than weight, so tasks heavier than 1 are under counted
+    for (auto &[name, capacity] : recorded_pools){
+        out << "pool " << pool_name(name) << "\n";
+        out << "  depth = " << capacity << "\n\n";
+    }
+
+    string exe = "lbuild";
+    error_code ec;
+    filesystem::path self_path = filesystem::read_symlink("/proc/self/exe", ec);
+    if (!ec){
+        exe = self_path.string();
+    }
+
+    string escaped_exe;
+    string escaped_script;
+    string escaped_path;
+    if (!escape_value(shell_quote(exe), escaped_exe) || !escape_path(script_path, escaped_script) || !escape_path(path, escaped_path)){
+        fprintf(stderr, "[lbuild error] Paths with new lines can't be written to %s\n", path.c_str());
+        return false;
+    }
+
+    out << "rule lbuild_regen\n";
+    out << "  command = " << escaped_exe << " --emit-ninja\n";
+    out << "  description = Regenerating " << path << "\n";
+    out << "  generator = 1\n";
+    out << "  restat = 1\n\n";
+    out << "build " << escaped_path << ": lbuild_regen " << escaped_script << "\n\n";
+
+    out << "rule lbuild_task\n";
+    out << "  command = $cmd\n";
+    out << "  description = $desc\n\n";
+
+    // Ninja hands the whole command to /bin/sh -c as one argument, so long ones run from a script instead
+    out << "rule lbuild_task_rsp\n";
+    out << "  command = /bin/sh $rspfile_arg\n";
+    out << "  rspfile_content = $cmd\n";
+    out << "  description = $desc\n\n";
+
+    map<string, bool> memo;
+    for (auto &[name, task] : tasks){
+        string escaped_name;
+        if (!escape_path(name, escaped_name)){
+            fprintf(stderr, "[lbuild error] Task names with new lines can't be written to %s\n", path.c_str());
+            return false;
+        }
+
+        // Dependencies that are files themselves make this task rebuild when they change, the rest only order it
+        string implicit_deps;
+        string order_deps;
+        for (const string& dep : task.deps){
+            string escaped_dep;
+            escape_path(dep, escaped_dep);
+            if (produces_files(dep, tasks, memo)){
+                implicit_deps += " " + escaped_dep;
+            } else {
+                order_deps += " " + escaped_dep;
+            }
+        }
+
+        if (!task.has_commands){
+            out << "build " << escaped_name << ": phony" << implicit_deps;
+            if (!order_deps.empty()){
+                out << " ||" << order_deps;
+            }
+            out << "\n\n";
+            continue;
+        }
+
+        string edge_outputs;
+        if (task.outputs.empty()){
+            escape_path(string(NINJA_STAMP_DIR) + "/" + name, edge_outputs);
+        } else {
+            for (const string& output : task.outputs){
+                edge_outputs += edge_outputs.empty() ? "" : " ";
+                if (!escape_path(output, edge_outputs)){
+                    fprintf(stderr, "[lbuild error] Output %s of task %s can't be written to %s\n", output.c_str(), name.c_str(), path.c_str());
+                    return false;
+                }
+            }
+        }
+
+        string edge_inputs;
+        for (const string& input : task.inputs){
+            edge_inputs += " ";
+            if (!escape_path(input, edge_inputs)){
+                fprintf(stderr, "[lbuild error] Input %s of task %s can't be written to %s\n", input.c_str(), name.c_str(), path.c_str());
+                return false;
+            }
+        }
+
+        string cmd;
+        for (const ProcessSpec& spec : recorded.at(name).commands){
+            if (spec.sandbox){
+                fprintf(stderr, "[lbuild] Task %s runs sandboxed commands, which ninja will run without a sandbox\n", name.c_str());
+            }
+            // Ninja can't pass a response file to each command like lbuild does
+            if (command_size(spec) > command_limit()){
+                fprintf(stderr, "[lbuild error] A command of task %s is over the system's argument limit of %zu bytes (E2BIG), which ninja can't run\n",
+                    name.c_str(), command_limit());
+                return false;
+            }
+            cmd += cmd.empty() ? "" : " && ";
+            cmd += command_line(spec);
+        }
+        string escaped_cmd;
+        if (!escape_value(cmd, escaped_cmd)){
+            fprintf(stderr, "[lbuild error] A command of task %s contains a new line, which ninja can't run\n", name.c_str());
+            return false;
+        }
+
+        bool use_rsp = cmd.size() + 1 > min(argument_limit(), command_limit());
+        out << "build " << edge_outputs << (use_rsp ? ": lbuild_task_rsp" : ": lbuild_task") << edge_inputs;
+        if (!implicit_deps.empty()){
+            out << " |" << implicit_deps;
+        }
+        if (!order_deps.empty()){
+            out << " ||" << order_deps;
+        }
+        out << "\n";
+        out << "  cmd = " << escaped_cmd << "\n";
+        out << "  desc = " << escaped_name << "\n";
+        if (use_rsp){
+            // Next to the first output, whose directory ninja creates before writing the script
+            string rsp_path = (task.outputs.empty() ? string(NINJA_STAMP_DIR) + "/" + name : task.outputs.front()) + ".rsp";
+            string escaped_rsp;
+            string escaped_rsp_arg;
+            escape_value(rsp_path, escaped_rsp);
+            escape_value(shell_quote(rsp_path), escaped_rsp_arg);
+            out << "  rspfile = " << escaped_rsp << "\n";
+            out << "  rspfile_arg = " << escaped_rsp_arg << "\n";
+        }
+        if (!task.pool.empty()){
+            out << "  pool = " << pool_name(task.pool) << "\n";
+        }
+
+        // Let the task be built by name unless one of its outputs already is that name
+        if (find(task.outputs.begin(), task.outputs.end(), name) == task.outputs.end()){
+            out << "build " << escaped_name << ": phony " << edge_outputs << "\n";
+        }
+        out << "\n";
+    }
+
+    // Like lbuild without arguments, plain ninja only brings the build file up to date
+    out << "default " << escaped_path << "\n";
+
+    string content = out.str();
+    ifstream existing(path, ios::binary);
+    if (existing){
+        stringstream current;
+        current << existing.rdbuf();
+        if (current.str() == content){
+            return true;
+        }
+    }
+
+    ofstream file(path, ios::binary | ios::trunc);
+    file << content;
+    if (!file){
+        fprintf(stderr, "[lbuild error] Unable to write %s\n", path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+void NinjaWriter::cleanup(){
+    recording = false;
+    recorded.clear();
+    recorded_pools.clear();
+    pass_root = "";
+    pass_commands.clear();
+    pass_edges.clear();
+}
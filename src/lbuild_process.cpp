@@ -0,0 +1,791 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+
+#include <string>
+#include <vector>
+#include <array>
+#include <unordered_set>
+#include <unordered_map>
+#include <algorithm>
+#include <filesystem>
+#include <mutex>
+
+#include "lbuild_process.h"
+#include "lbuild_stat.h"
+
+using namespace LBUILD;
+using namespace std;
+
+extern char** environ;
+
+enum SANDBOX_STEP {
+    SANDBOX_DIR,
+    SANDBOX_FILE,
+    SANDBOX_SYMLINK,
+    SANDBOX_BIND_RO,
+    SANDBOX_BIND_RW,
+    SANDBOX_DEV,
+    SANDBOX_PROC,
+    SANDBOX_TMP,
+};
+
+struct SandboxStep {
+    SANDBOX_STEP kind;
+    string source;
+    // Path inside the sandbox root, already prefixed with it
+    string target;
+};
+
+/**
+ * Everything the child needs to set up its sandbox, worked out before forking so the child only makes syscalls
+ */
+struct SandboxPlan {
+    string root;
+    string workdir;
+    string uid_map;
+    string gid_map;
+    vector<SandboxStep> steps;
+    // File outputs as {path inside the root, path on the host, temporary path next to it}
+    vector<array<string, 3>> copy_out;
+};
+
+// Directories from the host that every sandbox gets read only so compilers and shells still work
+static const char* sandbox_system_dirs[] = {"/bin", "/sbin", "/lib", "/lib32", "/lib64", "/libx32", "/usr", "/etc", NULL};
+
+static string sandbox_root = "";
+
+// Programs that read their arguments from @file, matched against the name of the program without any
+// target triple or version, e.g. x86_64-linux-gnu-gcc-12 is gcc
+static const char* response_file_programs[] = {
+    "cc", "c++", "gcc", "g++", "clang", "clang++", "cl", "ld", "ld.bfd", "ld.gold", "ld.lld", "lld", "link", "ar", "nvcc", NULL
+};
+
+// Response files are reused once their process has been reaped
+static mutex response_lock;
+static string response_dir = "";
+static vector<string> free_response_files;
+static vector<string> all_response_files;
+static unordered_map<pid_t, string> response_files_in_use;
+
+static void child_warn(const char* what, const char* path){
+    char buffer[2048];
+    int len = snprintf(buffer, sizeof(buffer), "[lbuild] %s %s: %s\n", what, path, strerror(errno));
+    if (len > 0){
+        write(STDERR_FILENO, buffer, min((size_t) len, sizeof(buffer) - 1));
+    }
+}
+
+[[noreturn]] static void child_fail(const char* what, const char* path){
+    child_warn(what, path);
+    _exit(127);
+}
+
+static bool write_file(const char* path, const string& contents){
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0){
+        return false;
+    }
+    bool ok = write(fd, contents.c_str(), contents.size()) == (ssize_t) contents.size();
+    close(fd);
+
+    return ok;
+}
+
+/**
+ * Creates a directory only this user can use under the system's temporary directory, returning its path or an empty string
+ *
+ * The name is random so nobody can create it, or a symlink with its name, before lbuild does
+ */
+static string make_private_dir(const string& prefix){
+    error_code ec;
+    filesystem::path tmp = filesystem::temp_directory_path(ec);
+    if (ec){
+        tmp = "/tmp";
+    }
+
+    string dir = (tmp / (prefix + "XXXXXX")).string();
+    if (mkdtemp(dir.data()) == NULL){
+        fprintf(stderr, "[lbuild] Unable to create a directory in %s: %s\n", tmp.c_str(), strerror(errno));
+        return "";
+    }
+
+    return dir;
+}
+
+static string get_sandbox_root(){
+    if (sandbox_root.empty()){
+        sandbox_root = make_private_dir("lbuild-sandbox-");
+    }
+
+    return sandbox_root;
+}
+
+static string program_name(const string& program){
+    string name = filesystem::path(program).filename().string();
+
+    // Strip a version suffix like -12 or -17.0
+    size_t dash = name.find_last_of('-');
+    if (dash != string::npos && dash + 1 < name.size() && name.find_first_not_of("0123456789.", dash + 1) == string::npos){
+        name = name.substr(0, dash);
+    }
+    // Strip a target triple like x86_64-linux-gnu-
+    dash = name.find_last_of('-');
+    if (dash != string::npos){
+        name = name.substr(dash + 1);
+    }
+
+    return name;
+}
+
+/**
+ * Finds program the way execvp would, but on the PATH of the environment the child gets rather than lbuild's own
+ *
+ * Relative PATH entries are checked against cwd, where the child runs. Returns 0 and stores the path in resolved
+ * or the errno execvp would have failed with
+ */
+static int resolve_program(const string& program, char* const* env, const string& cwd, string& resolved){
+    if (program.find('/') != string::npos){
+        resolved = program;
+        return 0;
+    }
+
+    // Same default as glibc when the environment has no PATH
+    string path = "/bin:/usr/bin";
+    for (size_t i = 0; env[i] != NULL; i++){
+        if (strncmp(env[i], "PATH=", 5) == 0){
+            path = env[i] + 5;
+            break;
+        }
+    }
+
+    int err = ENOENT;
+    size_t start = 0;
+    while (start <= path.size()){
+        size_t end = path.find(':', start);
+        if (end == string::npos){end = path.size();}
+
+        // An empty entry means the current directory
+        string dir = end > start ? path.substr(start, end - start) : ".";
+        string candidate = dir + "/" + program;
+        string checked = candidate;
+        if (dir.at(0) != '/' && !cwd.empty()){
+            checked = cwd + "/" + candidate;
+        }
+
+        struct stat st;
+        if (stat(checked.c_str(), &st) == 0 && S_ISREG(st.st_mode)){
+            if (access(checked.c_str(), X_OK) == 0){
+                resolved = candidate;
+                return 0;
+            }
+            err = EACCES;
+        }
+        start = end + 1;
+    }
+
+    return err;
+}
+
+static bool accepts_response_file(const ProcessSpec& spec){
+    if (spec.response_file != LBUILD_RSP_AUTO){
+        return spec.response_file == LBUILD_RSP_ON;
+    }
+
+    string name = program_name(spec.argv.at(0));
+    for (size_t i = 0; response_file_programs[i] != NULL; i++){
+        if (name == response_file_programs[i]){return true;}
+    }
+
+    return false;
+}
+
+size_t LBUILD::argument_limit(){
+    // Linux caps every single string at 32 pages on top of the overall limit
+    return 32 * (size_t) sysconf(_SC_PAGESIZE);
+}
+
+size_t LBUILD::command_limit(){
+    long arg_max = sysconf(_SC_ARG_MAX);
+    // Leave some room for the auxiliary vector and the program's file name
+    return arg_max > 4096 ? (size_t) arg_max - 2048 : 4096;
+}
+
+/**
+ * Returns the number of bytes execve needs for argv and env, or SIZE_MAX if a single argument is over the per argument limit
+ */
+static size_t command_size(char* const* argv, char* const* env){
+    const size_t max_arg_len = argument_limit();
+
+    size_t total = 0;
+    for (char* const* list : {argv, env}){
+        for (size_t i = 0; list[i] != NULL; i++){
+            size_t len = strlen(list[i]) + 1;
+            if (len > max_arg_len){return SIZE_MAX;}
+            total += len + sizeof(char*);
+        }
+    }
+
+    return total;
+}
+
+/**
+ * Writes the arguments after the program name to a response file from the pool, returning its path or an empty string
+ */
+static string write_response_file(const ProcessSpec& spec){
+    string path;
+    // Files from the pool already exist and are only truncated, new ones must not exist yet
+    int flags = O_WRONLY | O_NOFOLLOW | O_CLOEXEC;
+    {
+        lock_guard<mutex> guard(response_lock);
+        if (response_dir.empty()){
+            response_dir = make_private_dir("lbuild-rsp-");
+            if (response_dir.empty()){
+                return "";
+            }
+        }
+
+        if (!free_response_files.empty()){
+            path = free_response_files.back();
+            free_response_files.pop_back();
+            flags |= O_TRUNC;
+        } else {
+            path = response_dir + "/" + to_string(all_response_files.size()) + ".rsp";
+            all_response_files.push_back(path);
+            flags |= O_CREAT | O_EXCL;
+        }
+    }
+
+    // MSVC style tools only understand double quotes, everything else uses the gcc rules
+    string name = program_name(spec.argv.at(0));
+    bool msvc = name == "cl" || name == "link";
+
+    string contents;
+    for (size_t i = 1; i < spec.argv.size(); i++){
+        const string& arg = spec.argv.at(i);
+        if (msvc){
+            contents += '"';
+            for (char c : arg){
+                if (c == '"'){contents += '\\';}
+                contents += c;
+            }
+            contents += '"';
+        } else {
+            for (char c : arg){
+                if (c == ' ' || c == '\t' || c == '\n' || c == '\\' || c == '\'' || c == '"'){contents += '\\';}
+                contents += c;
+            }
+        }
+        contents += '\n';
+    }
+
+    int fd = open(path.c_str(), flags, 0600);
+    if (fd < 0 || write(fd, contents.data(), contents.size()) != (ssize_t) contents.size()){
+        fprintf(stderr, "[lbuild] Unable to write response file %s: %s\n", path.c_str(), strerror(errno));
+        if (fd >= 0){close(fd);}
+
+        // Only hand the file out again if it was created, otherwise the next user can't open it either
+        if (fd >= 0 || (flags & O_TRUNC)){
+            lock_guard<mutex> guard(response_lock);
+            free_response_files.push_back(path);
+        }
+        return "";
+    }
+    close(fd);
+
+    return path;
+}
+
+static void release_response_file(const string& path){
+    lock_guard<mutex> guard(response_lock);
+    free_response_files.push_back(path);
+}
+
+/**
+ * Adds a step creating every directory leading up to path (and path itself when include_self is set)
+ */
+static void plan_dirs(SandboxPlan& plan, unordered_set<string>& created, const filesystem::path& path, bool include_self){
+    vector<filesystem::path> chain;
+    filesystem::path cur = include_self ? path : path.parent_path();
+    while (cur.has_relative_path()){
+        chain.push_back(cur);
+        cur = cur.parent_path();
+    }
+
+    for (auto it = chain.rbegin(); it != chain.rend(); it++){
+        if (created.insert(it->string()).second){
+            plan.steps.push_back({SANDBOX_DIR, "", plan.root + it->string()});
+        }
+    }
+}
+
+static bool plan_sandbox(const ProcessSpec& spec, const vector<string>& extra_inputs, SandboxPlan& plan){
+    error_code ec;
+    unordered_set<string> created;
+    vector<SandboxStep> mounts;
+
+    plan.root = get_sandbox_root();
+    if (plan.root.empty()){
+        return false;
+    }
+    plan.uid_map = to_string(getuid()) + " " + to_string(getuid()) + " 1\n";
+    plan.gid_map = to_string(getgid()) + " " + to_string(getgid()) + " 1\n";
+
+    for (size_t i = 0; sandbox_system_dirs[i] != NULL; i++){
+        filesystem::path dir(sandbox_system_dirs[i]);
+        auto status = filesystem::symlink_status(dir, ec);
+        if (ec || !filesystem::exists(status)){
+            ec.clear();
+            continue;
+        }
+
+        if (filesystem::is_symlink(status)){
+            // Merged /usr systems link /bin and friends into /usr
+            plan.steps.push_back({SANDBOX_SYMLINK, filesystem::read_symlink(dir, ec).string(), plan.root + dir.string()});
+        } else if (filesystem::is_directory(status)){
+            plan_dirs(plan, created, dir, true);
+            mounts.push_back({SANDBOX_BIND_RO, dir.string(), plan.root + dir.string()});
+        }
+    }
+
+    plan_dirs(plan, created, "/dev", true);
+    mounts.push_back({SANDBOX_DEV, "/dev", plan.root + "/dev"});
+    plan_dirs(plan, created, "/proc", true);
+    mounts.push_back({SANDBOX_PROC, "", plan.root + "/proc"});
+    plan_dirs(plan, created, "/tmp", true);
+    plan.steps.push_back({SANDBOX_TMP, "", plan.root + "/tmp"});
+
+    vector<string> inputs = spec.inputs;
+    inputs.insert(inputs.end(), extra_inputs.begin(), extra_inputs.end());
+    for (const string& input : inputs){
+        filesystem::path path = filesystem::absolute(input, ec).lexically_normal();
+        if (!filesystem::exists(path, ec)){
+            fprintf(stderr, "[lbuild] Declared input %s does not exist\n", input.c_str());
+            return false;
+        }
+
+        plan_dirs(plan, created, path, false);
+        if (filesystem::is_directory(path, ec)){
+            plan_dirs(plan, created, path, true);
+        } else if (created.insert(path.string()).second){
+            plan.steps.push_back({SANDBOX_FILE, "", plan.root + path.string()});
+        }
+        mounts.push_back({SANDBOX_BIND_RO, path.string(), plan.root + path.string()});
+    }
+
+    for (const string& output : spec.outputs){
+        filesystem::path path = filesystem::absolute(output, ec).lexically_normal();
+        if (filesystem::is_directory(path, ec)){
+            plan_dirs(plan, created, path, true);
+            mounts.push_back({SANDBOX_BIND_RW, path.string(), plan.root + path.string()});
+            continue;
+        }
+
+        // Binding the directory of a file output would expose everything next to it, so the command writes into the
+        // sandbox's own tmpfs instead and the file is copied out once the command succeeds
+        filesystem::create_directories(path.parent_path(), ec);
+        plan_dirs(plan, created, path, false);
+        plan.copy_out.push_back({plan.root + path.string(), path.string(), path.string() + ".lbuild-tmp"});
+    }
+
+    filesystem::path workdir = spec.cwd.empty() ? filesystem::current_path(ec) : filesystem::absolute(spec.cwd, ec);
+    plan.workdir = workdir.lexically_normal().string();
+    plan_dirs(plan, created, plan.workdir, true);
+
+    // Mount parents before anything nested inside of them
+    stable_sort(mounts.begin(), mounts.end(), [](const SandboxStep& a, const SandboxStep& b){
+        return a.target.size() < b.target.size();
+    });
+    plan.steps.insert(plan.steps.end(), mounts.begin(), mounts.end());
+
+    return true;
+}
+
+static unsigned long locked_mount_flags(const char* path){
+    struct statvfs info;
+    if (statvfs(path, &info) < 0){
+        return 0;
+    }
+
+    unsigned long flags = 0;
+    if (info.f_flag & ST_NOSUID){flags |= MS_NOSUID;}
+    if (info.f_flag & ST_NODEV){flags |= MS_NODEV;}
+    if (info.f_flag & ST_NOEXEC){flags |= MS_NOEXEC;}
+    if (info.f_flag & ST_NOATIME){flags |= MS_NOATIME;}
+    if (info.f_flag & ST_NODIRATIME){flags |= MS_NODIRATIME;}
+    if (info.f_flag & ST_RELATIME){flags |= MS_RELATIME;}
+
+    return flags;
+}
+
+/**
+ * Moves the child into its sandbox. Only returns in the innermost process, which is pid 1 of the new pid namespace
+ *
+ * error_fd is closed in the intermediate process so the parent isn't kept waiting on it
+ */
+/**
+ * Copies a file output out of the sandbox, replacing the host file in one rename. Only makes syscalls so it is
+ * safe to call after forking
+ */
+static bool copy_out_of_sandbox(const char* from, const char* to, const char* tmp){
+    static char buffer[65536];
+
+    int in = open(from, O_RDONLY | O_CLOEXEC);
+    if (in < 0){
+        child_warn("Command did not create its declared output", to);
+        return false;
+    }
+    struct stat st;
+    fstat(in, &st);
+
+    int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, st.st_mode & 0777);
+    if (out < 0){
+        child_warn("Unable to write output", to);
+        close(in);
+        return false;
+    }
+
+    bool ok = true;
+    ssize_t len;
+    while ((len = read(in, buffer, sizeof(buffer))) != 0){
+        if (len < 0){
+            if (errno == EINTR){continue;}
+            ok = false;
+            break;
+        }
+        for (ssize_t done = 0; done < len;){
+            ssize_t written = write(out, buffer + done, len - done);
+            if (written < 0 && errno != EINTR){
+                ok = false;
+                break;
+            }
+            done += written > 0 ? written : 0;
+        }
+        if (!ok){break;}
+    }
+    close(in);
+    ok = close(out) == 0 && ok;
+
+    if (!ok || rename(tmp, to) < 0){
+        child_warn("Unable to write output", to);
+        unlink(tmp);
+        return false;
+    }
+
+    return true;
+}
+
+static void enter_sandbox(const SandboxPlan& plan, int error_fd){
+    if (unshare(CLONE_NEWUSER | CLONE_NEWNS | CLONE_NEWPID | CLONE_NEWNET) < 0){
+        child_fail("Unable to create namespaces for", "sandbox");
+    }
+
+    write_file("/proc/self/setgroups", "deny");
+    if (!write_file("/proc/self/uid_map", plan.uid_map)){
+        child_fail("Unable to write", "/proc/self/uid_map");
+    }
+    if (!write_file("/proc/self/gid_map", plan.gid_map)){
+        child_fail("Unable to write", "/proc/self/gid_map");
+    }
+
+    // The new pid namespace only applies to children so fork once more and pass the exit status through
+    pid_t inner = fork();
+    if (inner < 0){
+        child_fail("Unable to fork", "sandbox");
+    } else if (inner > 0){
+        close(error_fd);
+        int status = 0;
+        while (waitpid(inner, &status, 0) < 0 && errno == EINTR){}
+
+        // This process shares the sandbox's mounts but not its root, so it can still reach the host paths
+        int exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        for (size_t i = 0; i < plan.copy_out.size() && exit_code == 0; i++){
+            const array<string, 3>& output = plan.copy_out.at(i);
+            if (!copy_out_of_sandbox(output.at(0).c_str(), output.at(1).c_str(), output.at(2).c_str())){
+                exit_code = 1;
+            }
+        }
+        _exit(exit_code);
+    }
+
+    if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) < 0){
+        child_fail("Unable to make mounts private for", "sandbox");
+    }
+    if (mount("tmpfs", plan.root.c_str(), "tmpfs", 0, "mode=0755") < 0){
+        child_fail("Unable to mount sandbox root", plan.root.c_str());
+    }
+
+    for (const SandboxStep& step : plan.steps){
+        const char* target = step.target.c_str();
+        switch (step.kind){
+            case SANDBOX_DIR:{
+                if (mkdir(target, 0755) < 0 && errno != EEXIST){child_fail("Unable to create", target);}
+                break;
+            }
+
+            case SANDBOX_FILE:{
+                int fd = open(target, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+                if (fd < 0){child_fail("Unable to create", target);}
+                close(fd);
+                break;
+            }
+
+            case SANDBOX_SYMLINK:{
+                if (symlink(step.source.c_str(), target) < 0){child_fail("Unable to link", target);}
+                break;
+            }
+
+            case SANDBOX_BIND_RO:
+            case SANDBOX_BIND_RW:{
+                if (mount(step.source.c_str(), target, NULL, MS_BIND | MS_REC, NULL) < 0){
+                    child_fail("Unable to expose", step.source.c_str());
+                }
+                if (step.kind == SANDBOX_BIND_RO){
+                    // Best effort, the flags locked by the host mount have to be kept
+                    unsigned long flags = MS_REMOUNT | MS_BIND | MS_RDONLY | locked_mount_flags(step.source.c_str());
+                    mount(NULL, target, NULL, flags, NULL);
+                }
+                break;
+            }
+
+            case SANDBOX_DEV:{
+                if (mount(step.source.c_str(), target, NULL, MS_BIND | MS_REC, NULL) < 0){
+                    child_fail("Unable to expose", step.source.c_str());
+                }
+                break;
+            }
+
+            case SANDBOX_PROC:{
+                // Not every container allows a fresh procfs, commands rarely need it
+                mount("proc", target, "proc", MS_NOSUID | MS_NODEV | MS_NOEXEC, NULL);
+                break;
+            }
+
+            case SANDBOX_TMP:{
+                chmod(target, 01777);
+                break;
+            }
+        }
+    }
+
+    if (chdir(plan.root.c_str()) < 0 || chroot(".") < 0){
+        child_fail("Unable to enter sandbox", plan.root.c_str());
+    }
+    if (chdir(plan.workdir.c_str()) < 0){
+        child_fail("Unable to change directory to", plan.workdir.c_str());
+    }
+}
+
+pid_t LBUILD::spawn_process(const ProcessSpec& spec){
+    if (spec.argv.empty()){
+        fprintf(stderr, "Unable to start process: no command was given\n");
+        return -1;
+    }
+    // Build the argv, env and sandbox before forking so the child doesn't have to allocate
+    vector<char*> as_chars;
+    for (const string& s : spec.argv){
+        as_chars.push_back((char*) s.c_str());
+    }
+    as_chars.push_back(NULL);
+
+    vector<char*> env_chars;
+    for (const string& s : spec.env){
+        env_chars.push_back((char*) s.c_str());
+    }
+    env_chars.push_back(NULL);
+    char* const* child_env = spec.replace_env ? env_chars.data() : environ;
+
+    // Look the program up in the parent so the PATH given to exec is the one that counts
+    string program;
+    int resolve_errno = resolve_program(spec.argv.at(0), child_env, spec.cwd, program);
+    if (resolve_errno != 0){
+        fprintf(stderr, "[lbuild] Unable to run %s: %s\n", spec.argv.at(0).c_str(), strerror(resolve_errno));
+        return -1;
+    }
+
+    // execve would only fail with E2BIG in the child, so check the size up front
+    string response_path = "";
+    string response_arg = "";
+    size_t size = command_size(as_chars.data(), child_env);
+    if (size > command_limit()){
+        if (!accepts_response_file(spec)){
+            fprintf(stderr, "[lbuild] Unable to run %s: the command is over the system's argument limit of %zu bytes (E2BIG) "
+                "and %s is not known to accept response files. Pass responseFile = true to exec to use one anyway\n",
+                spec.argv.at(0).c_str(), command_limit(), spec.argv.at(0).c_str());
+            return -1;
+        }
+
+        response_path = write_response_file(spec);
+        if (response_path.empty()){
+            return -1;
+        }
+        response_arg = "@" + response_path;
+        as_chars = {as_chars.at(0), (char*) response_arg.c_str(), NULL};
+
+        if (command_size(as_chars.data(), child_env) > command_limit()){
+            fprintf(stderr, "[lbuild] Unable to run %s: its environment alone is over the system's argument limit (E2BIG)\n", spec.argv.at(0).c_str());
+            release_response_file(response_path);
+            return -1;
+        }
+    }
+
+    SandboxPlan plan;
+    vector<string> extra_inputs;
+    if (!response_path.empty()){
+        extra_inputs.push_back(response_path);
+    }
+    if (spec.sandbox && !plan_sandbox(spec, extra_inputs, plan)){
+        if (!response_path.empty()){release_response_file(response_path);}
+        return -1;
+    }
+
+    // The child reports a failed exec through this pipe, which closes by itself once exec succeeds
+    int error_pipe[2];
+    if (pipe2(error_pipe, O_CLOEXEC) < 0){
+        perror("Unable to create pipe for process");
+        if (!response_path.empty()){release_response_file(response_path);}
+        return -1;
+    }
+
+    pid_t exec_process = fork();
+    if (exec_process < 0){
+        fprintf(stderr, "Unable to fork process\n");
+        close(error_pipe[0]);
+        close(error_pipe[1]);
+        if (!response_path.empty()){release_response_file(response_path);}
+        return -1;
+    } else if (exec_process == 0){
+        // Child process
+        close(error_pipe[0]);
+        if (!spec.stdin_path.empty()){
+            int fd = open(spec.stdin_path.c_str(), O_RDONLY);
+            if (fd < 0 || dup2(fd, STDIN_FILENO) < 0){
+                child_fail("Unable to open stdin", spec.stdin_path.c_str());
+            }
+            close(fd);
+        }
+
+        if (spec.sandbox){
+            enter_sandbox(plan, error_pipe[1]);
+        } else if (!spec.cwd.empty() && chdir(spec.cwd.c_str()) < 0){
+            child_fail("Unable to change directory to", spec.cwd.c_str());
+        }
+
+        execve(program.c_str(), as_chars.data(), child_env);
+
+        int exec_errno = errno;
+        write(error_pipe[1], &exec_errno, sizeof(exec_errno));
+        _exit(127);
+    }
+
+    close(error_pipe[1]);
+    int exec_errno = 0;
+    ssize_t res;
+    do {
+        res = read(error_pipe[0], &exec_errno, sizeof(exec_errno));
+    } while (res < 0 && errno == EINTR);
+    close(error_pipe[0]);
+
+    if (!response_path.empty()){
+        lock_guard<mutex> guard(response_lock);
+        response_files_in_use.insert_or_assign(exec_process, response_path);
+    }
+
+    if (res == sizeof(exec_errno)){
+        if (exec_errno == E2BIG){
+            fprintf(stderr, "[lbuild] Unable to run %s: the command is over the system's argument limit (E2BIG)\n", spec.argv.at(0).c_str());
+        } else {
+            fprintf(stderr, "[lbuild] Unable to run %s: %s\n", spec.argv.at(0).c_str(), strerror(exec_errno));
+        }
+
+        int exit_code = -1;
+        reap_process(exec_process, true, &exit_code);
+        return -1;
+    }
+
+    return exec_process;
+}
+
+int LBUILD::open_pidfd(pid_t pid){
+#ifdef SYS_pidfd_open
+    return (int) syscall(SYS_pidfd_open, pid, 0);
+#else
+    return -1;
+#endif
+}
+
+bool LBUILD::reap_process(pid_t pid, bool block, int* exit_code){
+    int status = 0;
+    pid_t res;
+    do {
+        res = waitpid(pid, &status, block ? 0 : WNOHANG);
+    } while (res < 0 && errno == EINTR);
+
+    if (res == 0){
+        return false;
+    }
+
+    {
+        lock_guard<mutex> guard(response_lock);
+        auto response = response_files_in_use.find(pid);
+        if (response != response_files_in_use.end()){
+            free_response_files.push_back(response->second);
+            response_files_in_use.erase(response);
+        }
+    }
+
+    if (res < 0){
+        *exit_code = -1;
+    } else if (WIFEXITED(status)){
+        *exit_code = WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)){
+        *exit_code = 128 + WTERMSIG(status);
+    } else {
+        *exit_code = -1;
+    }
+
+    return true;
+}
+
+int LBUILD::run_process(const ProcessSpec& spec){
+    pid_t pid = spawn_process(spec);
+    if (pid < 0){
+        return -1;
+    }
+
+    int exit_code = -1;
+    reap_process(pid, true, &exit_code);
+    for (const string& output : spec.outputs){
+        StatCache::invalidate(output);
+    }
+
+    return exit_code;
+}
+
+void LBUILD::cleanup_processes(){
+    if (!sandbox_root.empty()){
+        rmdir(sandbox_root.c_str());
+        sandbox_root = "";
+    }
+
+    lock_guard<mutex> guard(response_lock);
+    for (const string& path : all_response_files){
+        unlink(path.c_str());
+    }
+    if (!response_dir.empty()){
+        rmdir(response_dir.c_str());
+    }
+    response_dir = "";
+    all_response_files.clear();
+    free_response_files.clear();
+    response_files_in_use.clear();
+}
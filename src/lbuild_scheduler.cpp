@@ -0,0 +1,496 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+
+#include "lbuild_scheduler.h"
+#include "lbuild_target.h"
+#include "lbuild_process.h"
+#include "lbuild_workers.h"
+#include "lbuild_stat.h"
+#include "lbuild_ninja.h"
+
+#include "lua.h"
+#include "lualib.h"
+
+using namespace LBUILD;
+using namespace std;
+
+unordered_map<string, ResourcePool> Scheduler::pools = {};
+int Scheduler::jobs = max(1u, thread::hardware_concurrency());
+double Scheduler::memory_pressure_limit = 0;
+Scheduler* Scheduler::active = NULL;
+
+Scheduler::Scheduler(lua_State* l){
+    this->l = l;
+    this->failed = false;
+    this->throttled = false;
+    this->jobs_in_use = 0;
+    this->remote_running = 0;
+}
+
+void Scheduler::add_pool(string name, int capacity){
+    if (pools.find(name) != pools.end()){
+        char buffer[1024];
+        snprintf(buffer, sizeof(buffer), "pool %s already exists", name.c_str());
+        throw invalid_argument(buffer);
+    }
+
+    pools.insert_or_assign(name, ResourcePool{capacity, 0});
+}
+
+bool Scheduler::has_pool(string name){
+    return pools.find(name) != pools.end();
+}
+
+const unordered_map<string, ResourcePool>& Scheduler::get_pools(){
+    return pools;
+}
+
+void Scheduler::set_jobs(int jobs){
+    Scheduler::jobs = max(1, jobs);
+}
+
+int Scheduler::get_jobs(){
+    return jobs;
+}
+
+void Scheduler::set_memory_pressure_limit(double limit){
+    memory_pressure_limit = limit;
+}
+
+Scheduler* Scheduler::get_active(){
+    return active;
+}
+
+void Scheduler::cleanup(){
+    pools.clear();
+}
+
+void Scheduler::schedule(shared_ptr<BuildTarget> target){
+    if (this->scheduled_set.count(target.get()) > 0){
+        return;
+    }
+
+    this->scheduled_set.insert(target.get());
+    this->scheduled.push_back(target);
+
+    for (auto dep : target->get_dependencies()){
+        this->schedule(dep);
+    }
+}
+
+int Scheduler::run(vector<shared_ptr<BuildTarget>> targets){
+    // Every pass runs its targets from scratch
+    for (auto &[k,v] : BuildTarget::registered_targets){
+        v->set_state(LBUILD_TARGET_PENDING);
+    }
+
+    active = this;
+    for (auto target : targets){
+        this->schedule(target);
+    }
+
+    while (true){
+        bool progressed = this->start_ready_targets();
+        this->launch_jobs();
+
+        if (this->running.empty() && this->remote_running == 0){
+            if (!progressed){
+                this->report_stuck_targets();
+                break;
+            }
+            continue;
+        }
+
+        this->wait_for_jobs();
+    }
+
+    // Anything still running at this point was stopped by a failure elsewhere
+    for (auto target : this->scheduled){
+        if (target->get_state() == LBUILD_TARGET_RUNNING){
+            target->release(this->l);
+            target->set_state(LBUILD_TARGET_FAILED);
+        }
+    }
+    this->queued.clear();
+    active = NULL;
+
+    for (auto target : targets){
+        if (target->get_state() != LBUILD_TARGET_DONE){
+            return LUA_ERRRUN;
+        }
+    }
+
+    return LUA_OK;
+}
+
+void Scheduler::report_stuck_targets(){
+    // After a failure the remaining targets are left pending on purpose
+    if (this->failed){
+        return;
+    }
+
+    string stuck = "";
+    for (auto target : this->scheduled){
+        LBUILD_TARGET_STATE state = target->get_state();
+        if (state == LBUILD_TARGET_PENDING || state == LBUILD_TARGET_RUNNING){
+            stuck += (stuck.empty() ? "" : ", ") + target->get_name();
+        }
+    }
+    if (!stuck.empty()){
+        fprintf(stderr, "[lbuild error] Tasks are waiting on each other and none of them can continue: %s\n", stuck.c_str());
+        this->failed = true;
+    }
+}
+
+bool Scheduler::waits_on(BuildTarget* from, BuildTarget* to){
+    vector<BuildTarget*> stack = {from};
+    unordered_set<BuildTarget*> visited;
+    while (!stack.empty()){
+        BuildTarget* current = stack.back();
+        stack.pop_back();
+        if (current == to){
+            return true;
+        }
+        if (!visited.insert(current).second){
+            continue;
+        }
+
+        auto waiting = this->waiting_on.find(current);
+        if (waiting != this->waiting_on.end()){
+            stack.push_back(waiting->second);
+        }
+        // A target that hasn't started yet waits on its unfinished dependencies
+        if (current->get_state() == LBUILD_TARGET_PENDING){
+            for (auto dep : current->get_dependencies()){
+                if (dep->get_state() != LBUILD_TARGET_DONE){
+                    stack.push_back(dep.get());
+                }
+            }
+        }
+    }
+
+    return false;
+}
+
+bool Scheduler::start_ready_targets(){
+    bool progressed = false;
+
+    // Index based since starting a target can schedule more of them
+    for (size_t i = 0; i < this->scheduled.size() && !this->failed; i++){
+        shared_ptr<BuildTarget> target = this->scheduled.at(i);
+        if (target->get_state() != LBUILD_TARGET_PENDING){continue;}
+
+        bool ready = true;
+        for (auto dep : target->get_dependencies()){
+            if (dep->get_state() == LBUILD_TARGET_FAILED){
+                fprintf(stderr, "Skipping task %s: dependency %s failed\n", target->get_name().c_str(), dep->get_name().c_str());
+                ready = false;
+                this->finish_target(target, LUA_ERRRUN);
+                break;
+            } else if (dep->get_state() != LBUILD_TARGET_DONE){
+                ready = false;
+            }
+        }
+
+        if (target->get_state() == LBUILD_TARGET_FAILED){
+            progressed = true;
+            continue;
+        }
+        if (!ready){continue;}
+
+        progressed = true;
+        if (target->is_isolated() && WorkerPool::enabled()){
+            target->set_state(LBUILD_TARGET_RUNNING);
+            this->blocked.insert(target.get());
+            this->remote_running++;
+            WorkerPool::dispatch(target);
+            continue;
+        }
+        this->handle_resume(target, target->run(this->l));
+    }
+
+    return progressed;
+}
+
+bool Scheduler::memory_pressure_high(){
+    if (memory_pressure_limit <= 0){
+        return false;
+    }
+
+    FILE* pressure_file = fopen("/proc/pressure/memory", "r");
+    if (pressure_file == NULL){
+        return false;
+    }
+
+    double avg10 = 0;
+    int matched = fscanf(pressure_file, "some avg10=%lf", &avg10);
+    fclose(pressure_file);
+
+    return matched == 1 && avg10 >= memory_pressure_limit;
+}
+
+void Scheduler::launch_jobs(){
+    if (this->failed){
+        // Workers still need an answer so their tasks can wind down
+        for (auto it = this->queued.begin(); it != this->queued.end();){
+            if (it->remote_result != NULL){
+                it->remote_result->set_value(-1);
+                it = this->queued.erase(it);
+            } else {
+                it++;
+            }
+        }
+        return;
+    }
+    if (this->queued.empty()){
+        return;
+    }
+
+    if (NinjaWriter::is_recording()){
+        // Completing a job resumes its task, which may queue the next command straight away
+        while (!this->queued.empty()){
+            Job job = move(this->queued.front());
+            this->queued.pop_front();
+            NinjaWriter::record_command(job.target->get_name(), job.spec);
+            this->complete_job(job, 0);
+        }
+        return;
+    }
+
+    // Always allow one job through so a pressured machine still makes progress
+    bool was_throttled = this->throttled;
+    this->throttled = !this->running.empty() && this->memory_pressure_high();
+    if (this->throttled){
+        if (!was_throttled){
+            fprintf(stderr, "[lbuild] memory pressure is above %.2f%%, holding back new commands\n", memory_pressure_limit);
+        }
+        return;
+    }
+
+    vector<Job> unstarted;
+    auto it = this->queued.begin();
+    while (it != this->queued.end()){
+        // Stop at the first job that doesn't fit the global budget so heavy jobs aren't starved by light ones
+        if (this->jobs_in_use + it->weight > jobs){break;}
+
+        auto pool = pools.find(it->pool);
+        if (pool != pools.end() && pool->second.in_use + it->weight > pool->second.capacity){
+            it++;
+            continue;
+        }
+
+        Job job = move(*it);
+        it = this->queued.erase(it);
+
+        job.pid = spawn_process(job.spec);
+        if (job.pid < 0){
+            unstarted.push_back(move(job));
+            continue;
+        }
+        job.pidfd = open_pidfd(job.pid);
+
+        this->jobs_in_use += job.weight;
+        if (pool != pools.end()){
+            pool->second.in_use += job.weight;
+        }
+        this->running.push_back(move(job));
+    }
+
+    for (Job& job : unstarted){
+        this->complete_job(job, -1);
+    }
+}
+
+void Scheduler::wait_for_jobs(){
+    vector<struct pollfd> fds;
+    bool has_unpollable = false;
+    if (this->remote_running > 0){
+        fds.push_back({WorkerPool::get_event_fd(), POLLIN, 0});
+    }
+    size_t fd_index = fds.size();
+    for (Job& job : this->running){
+        if (job.pidfd >= 0){
+            fds.push_back({job.pidfd, POLLIN, 0});
+        } else {
+            has_unpollable = true;
+        }
+    }
+
+    // Without pidfds fall back to polling waitpid
+    int timeout = -1;
+    if (has_unpollable){
+        timeout = 50;
+    } else if (this->throttled){
+        timeout = 500;
+    }
+
+    if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR){
+        perror("Unable to wait for running commands");
+    }
+
+    vector<Job> still_running;
+    vector<pair<Job, int>> finished;
+    for (Job& job : this->running){
+        int exit_code = -1;
+        bool done = false;
+        if (job.pidfd >= 0){
+            if (fds.at(fd_index++).revents != 0){
+                done = reap_process(job.pid, true, &exit_code);
+            }
+        } else {
+            done = reap_process(job.pid, false, &exit_code);
+        }
+
+        if (!done){
+            still_running.push_back(move(job));
+            continue;
+        }
+
+        if (job.pidfd >= 0){
+            close(job.pidfd);
+        }
+        this->jobs_in_use -= job.weight;
+        auto pool = pools.find(job.pool);
+        if (pool != pools.end()){
+            pool->second.in_use -= job.weight;
+        }
+        finished.push_back({move(job), exit_code});
+    }
+    this->running = move(still_running);
+
+    for (auto &[job, exit_code] : finished){
+        // The command may have rewritten its outputs so their cached stats can't be trusted anymore
+        for (const string& output : job.spec.outputs){
+            StatCache::invalidate(output);
+        }
+        this->complete_job(job, exit_code);
+    }
+
+    if (this->remote_running > 0){
+        this->handle_worker_messages();
+    }
+}
+
+void Scheduler::handle_worker_messages(){
+    for (WorkerMessage& msg : WorkerPool::drain()){
+        switch (msg.kind){
+            case LBUILD_WORKER_EXEC:{
+                this->submit_job(msg.target, move(msg.spec), msg.result);
+                break;
+            }
+
+            case LBUILD_WORKER_DONE:{
+                this->remote_running--;
+                if (msg.status != LUA_OK){
+                    fprintf(stderr, "Unable to run function for build target %s: %s\n", msg.target->get_name().c_str(), msg.error.c_str());
+                }
+                this->finish_target(msg.target, msg.status);
+                break;
+            }
+        }
+    }
+}
+
+void Scheduler::complete_job(Job& job, int exit_code){
+    if (job.remote_result != NULL){
+        // The target keeps running on its worker
+        job.remote_result->set_value(exit_code);
+        return;
+    }
+
+    shared_ptr<BuildTarget> target = job.target;
+    this->blocked.erase(target.get());
+
+    // The exit code becomes the result of the lbuild.exec call that yielded
+    lua_pushinteger(target->get_thread(), exit_code);
+    this->handle_resume(target, target->resume(1));
+}
+
+void Scheduler::handle_resume(shared_ptr<BuildTarget> target, int status){
+    if (status == LUA_YIELD){
+        if (this->blocked.count(target.get()) > 0){
+            return;
+        }
+        fprintf(stderr, "Task %s yielded outside of lbuild.exec or lbuild.runTask\n", target->get_name().c_str());
+        status = LUA_ERRRUN;
+    }
+
+    this->finish_target(target, status);
+}
+
+void Scheduler::finish_target(shared_ptr<BuildTarget> target, int status){
+    this->blocked.erase(target.get());
+    target->release(this->l);
+
+    if (status == LUA_OK){
+        target->set_state(LBUILD_TARGET_DONE);
+    } else {
+        target->set_state(LBUILD_TARGET_FAILED);
+        this->failed = true;
+    }
+
+    auto it = this->waiters.find(target.get());
+    if (it == this->waiters.end()){
+        return;
+    }
+    vector<shared_ptr<BuildTarget>> to_wake = move(it->second);
+    this->waiters.erase(it);
+
+    for (auto waiter : to_wake){
+        this->blocked.erase(waiter.get());
+        this->waiting_on.erase(waiter.get());
+        lua_pushboolean(waiter->get_thread(), status == LUA_OK);
+        this->handle_resume(waiter, waiter->resume(1));
+    }
+}
+
+void Scheduler::submit_job(shared_ptr<BuildTarget> target, ProcessSpec spec, shared_ptr<promise<int>> remote_result){
+    // Clamp the weight so a job can always run once everything else has finished
+    int weight = min(target->get_weight(), jobs);
+    auto pool = pools.find(target->get_pool());
+    if (pool != pools.end()){
+        weight = min(weight, pool->second.capacity);
+    }
+
+    this->queued.push_back(Job{target, move(spec), weight, target->get_pool(), -1, -1, remote_result});
+    this->blocked.insert(target.get());
+}
+
+LBUILD_TARGET_STATE Scheduler::wait_target(shared_ptr<BuildTarget> waiter, shared_ptr<BuildTarget> target){
+    this->schedule(target);
+    if (NinjaWriter::is_recording()){
+        NinjaWriter::record_edge(waiter->get_name(), target->get_name());
+    }
+
+    LBUILD_TARGET_STATE state = target->get_state();
+    if (state == LBUILD_TARGET_DONE || state == LBUILD_TARGET_FAILED){
+        return state;
+    }
+
+    if (this->waits_on(target.get(), waiter.get())){
+        throw invalid_argument("tasks " + waiter->get_name() + " and " + target->get_name() + " wait on each other through runTask");
+    }
+
+    this->waiters[target.get()].push_back(waiter);
+    this->waiting_on.insert_or_assign(waiter.get(), target.get());
+    this->blocked.insert(waiter.get());
+
+    return state;
+}
+
+void Scheduler::add_dependency(shared_ptr<BuildTarget> target, shared_ptr<BuildTarget> dep){
+    if (this->scheduled_set.count(target.get()) > 0){
+        this->schedule(dep);
+    }
+}
@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <filesystem>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include "lbuild_stat.h"
+
+using namespace LBUILD;
+using namespace std;
+
+// Below this many paths a batch isn't worth waking the stat threads for
+#define STAT_BATCH_PER_THREAD 512
+// How many paths a thread takes from a batch at a time
+#define STAT_CHUNK 128
+
+static mutex cache_lock;
+static unordered_map<string, uint32_t> path_ids;
+// The keys of path_ids by id, which stay put while the map grows
+static vector<const string*> id_paths;
+static vector<FileStat> stats;
+static vector<char> cached;
+// Bumped by every invalidate so a stat that raced with one isn't stored
+static vector<uint64_t> generations;
+
+// Threads that help prefetch with large batches, started on first use and kept until cleanup
+static vector<thread> stat_threads;
+// Held by the prefetch using the stat threads, any other prefetch stats on its own thread meanwhile
+static mutex pool_lock;
+static mutex batch_lock;
+static condition_variable batch_ready;
+static condition_variable batch_done;
+static const vector<const char*>* batch_paths = NULL;
+static vector<FileStat>* batch_results = NULL;
+static atomic<size_t> batch_next;
+static uint64_t batch_serial = 0;
+static int batch_workers = 0;
+static bool stopping = false;
+
+/**
+ * Returns true if path has an empty, . or .. component that lexically_normal would remove
+ */
+static bool needs_normalize(const string& path){
+    size_t start = 0;
+    while (start <= path.size()){
+        size_t end = path.find('/', start);
+        if (end == string::npos){end = path.size();}
+
+        size_t len = end - start;
+        bool leading_root = start == 0 && len == 0 && path.size() > 0;
+        if ((len == 0 && !leading_root) || (len == 1 && path[start] == '.') || (len == 2 && path[start] == '.' && path[start + 1] == '.')){
+            return true;
+        }
+        start = end + 1;
+    }
+
+    return false;
+}
+
+static string normalize(const string& path){
+    // lexically_normal is slow enough to dominate no-op builds, so skip it for the common already normal path
+    if (!needs_normalize(path)){
+        return path;
+    }
+    return filesystem::path(path).lexically_normal().string();
+}
+
+static uint32_t intern_locked(const string& path){
+    // Only copy the path when it is new or has to be normalised
+    bool normal = !needs_normalize(path);
+    string key;
+    if (!normal){
+        key = filesystem::path(path).lexically_normal().string();
+    }
+    auto it = path_ids.find(normal ? path : key);
+    if (it != path_ids.end()){
+        return it->second;
+    }
+
+    uint32_t id = (uint32_t) stats.size();
+    it = path_ids.insert({normal ? path : move(key), id}).first;
+    id_paths.push_back(&it->first);
+    stats.push_back({false, false, 0, 0});
+    cached.push_back(false);
+    generations.push_back(0);
+
+    return id;
+}
+
+/**
+ * Makes room for count paths at once, since growing the table path by path is most of the cost of a large first prefetch
+ */
+static void reserve_locked(size_t count){
+    if (count <= stats.capacity()){
+        return;
+    }
+    // Still grow geometrically so many small batches don't reallocate every time
+    count = max(count, 2 * stats.capacity());
+    path_ids.reserve(count);
+    id_paths.reserve(count);
+    stats.reserve(count);
+    cached.reserve(count);
+    generations.reserve(count);
+}
+
+static FileStat stat_path(const char* path){
+    FileStat res{false, false, 0, 0};
+#ifdef STATX_MTIME
+    struct statx buf;
+    if (statx(AT_FDCWD, path, AT_STATX_SYNC_AS_STAT, STATX_TYPE | STATX_MTIME | STATX_SIZE, &buf) == 0){
+        res.exists = true;
+        res.is_dir = S_ISDIR(buf.stx_mode);
+        res.mtime_ns = (int64_t) buf.stx_mtime.tv_sec * 1000000000 + buf.stx_mtime.tv_nsec;
+        res.size = buf.stx_size;
+    }
+#else
+    struct stat buf;
+    if (stat(path, &buf) == 0){
+        res.exists = true;
+        res.is_dir = S_ISDIR(buf.st_mode);
+        res.mtime_ns = (int64_t) buf.st_mtim.tv_sec * 1000000000 + buf.st_mtim.tv_nsec;
+        res.size = buf.st_size;
+    }
+#endif
+    return res;
+}
+
+/**
+ * Stats chunks of the current batch until none are left
+ */
+static void stat_chunks(){
+    size_t size = batch_results->size();
+    while (true){
+        size_t begin = batch_next.fetch_add(STAT_CHUNK);
+        if (begin >= size){
+            break;
+        }
+        size_t end = min(begin + STAT_CHUNK, size);
+        for (size_t i = begin; i < end; i++){
+            (*batch_results)[i] = stat_path((*batch_paths)[i]);
+        }
+    }
+}
+
+static void stat_thread_main(){
+    uint64_t seen = 0;
+    unique_lock<mutex> guard(batch_lock);
+    while (true){
+        batch_ready.wait(guard, [&]{return stopping || batch_serial != seen;});
+        if (stopping){
+            return;
+        }
+        seen = batch_serial;
+        // The batch may already be finished by the time this thread wakes up
+        if (batch_results == NULL){
+            continue;
+        }
+
+        batch_workers++;
+        guard.unlock();
+        stat_chunks();
+        guard.lock();
+        batch_workers--;
+        if (batch_workers == 0){
+            batch_done.notify_all();
+        }
+    }
+}
+
+/**
+ * Stats paths into results, together with the stat threads if the batch is big enough and they are free
+ */
+static void stat_batch(const vector<const char*>& paths, vector<FileStat>& results){
+    size_t cores = max(1u, thread::hardware_concurrency());
+    unique_lock<mutex> pool(pool_lock, defer_lock);
+    if (cores == 1 || paths.size() < 2 * STAT_BATCH_PER_THREAD || !pool.try_lock()){
+        for (size_t i = 0; i < paths.size(); i++){
+            results[i] = stat_path(paths[i]);
+        }
+        return;
+    }
+
+    unique_lock<mutex> guard(batch_lock);
+    while (stat_threads.size() < cores - 1){
+        stat_threads.emplace_back(stat_thread_main);
+    }
+    batch_paths = &paths;
+    batch_results = &results;
+    batch_next = 0;
+    batch_serial++;
+    guard.unlock();
+    batch_ready.notify_all();
+
+    stat_chunks();
+
+    guard.lock();
+    batch_done.wait(guard, []{return batch_workers == 0;});
+    batch_paths = NULL;
+    batch_results = NULL;
+}
+
+FileStat StatCache::get(const string& path){
+    uint32_t id;
+    {
+        lock_guard<mutex> guard(cache_lock);
+        id = intern_locked(path);
+    }
+
+    return get(id);
+}
+
+FileStat StatCache::get(uint32_t id){
+    string path;
+    uint64_t generation;
+    {
+        lock_guard<mutex> guard(cache_lock);
+        if (cached.at(id)){
+            return stats.at(id);
+        }
+        path = *id_paths.at(id);
+        generation = generations.at(id);
+    }
+
+    FileStat res = stat_path(path.c_str());
+
+    lock_guard<mutex> guard(cache_lock);
+    if (generations.at(id) == generation){
+        stats.at(id) = res;
+        cached.at(id) = true;
+    }
+
+    return res;
+}
+
+vector<uint32_t> StatCache::prefetch(const vector<string>& paths){
+    vector<uint32_t> ids;
+    vector<uint32_t> missing_ids;
+    vector<uint64_t> missing_generations;
+    vector<const char*> missing_paths;
+    ids.reserve(paths.size());
+    {
+        lock_guard<mutex> guard(cache_lock);
+        reserve_locked(stats.size() + paths.size());
+        for (const string& path : paths){
+            // Duplicates are just statted twice, which is cheaper than finding them
+            uint32_t id = intern_locked(path);
+            ids.push_back(id);
+            if (!cached.at(id)){
+                missing_ids.push_back(id);
+                missing_generations.push_back(generations.at(id));
+                missing_paths.push_back(path.c_str());
+            }
+        }
+    }
+    if (missing_ids.empty()){
+        return ids;
+    }
+
+    // Every thread fills its own slots of results so they don't need the lock
+    vector<FileStat> results(missing_ids.size());
+    stat_batch(missing_paths, results);
+
+    lock_guard<mutex> guard(cache_lock);
+    for (size_t i = 0; i < missing_ids.size(); i++){
+        uint32_t id = missing_ids.at(i);
+        if (generations.at(id) != missing_generations.at(i)){
+            continue;
+        }
+        stats.at(id) = results.at(i);
+        cached.at(id) = true;
+    }
+
+    return ids;
+}
+
+void StatCache::invalidate(const string& path){
+    lock_guard<mutex> guard(cache_lock);
+    auto it = path_ids.find(normalize(path));
+    if (it != path_ids.end()){
+        cached.at(it->second) = false;
+        generations.at(it->second)++;
+    }
+}
+
+void StatCache::invalidate_all(){
+    lock_guard<mutex> guard(cache_lock);
+    fill(cached.begin(), cached.end(), false);
+    for (uint64_t& generation : generations){
+        generation++;
+    }
+}
+
+void StatCache::cleanup(){
+    {
+        lock_guard<mutex> guard(batch_lock);
+        stopping = true;
+    }
+    batch_ready.notify_all();
+    for (thread& t : stat_threads){
+        t.join();
+    }
+    stat_threads.clear();
+    stopping = false;
+
+    lock_guard<mutex> guard(cache_lock);
+    path_ids.clear();
+    id_paths.clear();
+    stats.clear();
+    cached.clear();
+    generations.clear();
+}
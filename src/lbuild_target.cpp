@@ -8,6 +8,7 @@
 #include <string>
 #include <memory>
 #include <unordered_map>
+#include <unordered_set>
 #include <stack>
 #include <queue>
 
@@ -17,7 +18,10 @@ std::unordered_map<std::string, std::shared_ptr<BuildTarget>> BuildTarget::regis
 
 bool BuildTarget::has_circular_dependency(shared_ptr<BuildTarget> tgt1, shared_ptr<BuildTarget> tgt2){
     std::queue<std::shared_ptr<BuildTarget>> process_queue;
+    // Shared dependencies only need to be explored once
+    std::unordered_set<BuildTarget*> visited;
     process_queue.push(tgt2);
+    visited.insert(tgt2.get());
     while (!process_queue.empty()){
         auto cur = process_queue.front();
         process_queue.pop();
@@ -26,7 +30,9 @@ bool BuildTarget::has_circular_dependency(shared_ptr<BuildTarget> tgt1, shared_p
 
         if (cur.get() == tgt1.get()){return true;}
         for (auto v : cur->dependencies){
-            process_queue.push(v);
+            if (visited.insert(v.get()).second){
+                process_queue.push(v);
+            }
         }
     }
 
@@ -45,6 +51,12 @@ static bool key_exists(std::string key_name){
 BuildTarget::BuildTarget(std::string task_name){
     this->target_name = task_name;
     this->dependencies = {};
+    this->weight = 1;
+    this->pool = "";
+    this->isolated = false;
+    this->state = LBUILD_TARGET_PENDING;
+    this->thread = NULL;
+    this->thread_ref = LUA_NOREF;
 }
 
 std::shared_ptr<BuildTarget> BuildTarget::create_target(std::string task_name){
@@ -79,48 +91,74 @@ void BuildTarget::cleanup(){
 }
 
 int BuildTarget::run(lua_State* l){
-    // Run all the dependencies
-    for (std::shared_ptr<BuildTarget> dep : this->dependencies){
-        dep->run(l);
-    }
+    this->state = LBUILD_TARGET_RUNNING;
+    // Every run callback gets its own thread so it can yield back to the scheduler while its commands execute
+    this->thread = lua_newthread(l);
+    this->thread_ref = lua_ref(l, -1);
+    lua_pop(l, 1);
+
+    lua_State* co = this->thread;
     // Fetch the lua function associated with this build rule
-    lua_getglobal(l, "_X");
-    lua_pushstring(l, this->target_name.c_str());
-    lua_gettable(l, -2);
+    lua_getglobal(co, "_X");
+    lua_pushstring(co, this->target_name.c_str());
+    lua_gettable(co, -2);
 
-    if (lua_isnil(l, -1)){
+    if (lua_isnil(co, -1)){
         fprintf(stderr, "No lua function is registered in _X for build target %s\n", this->target_name.c_str());
         return LUA_ERRRUN;
     }
     // Get the f and u from the container
-    lua_pushstring(l, "f");
-    lua_gettable(l, -2);
+    lua_pushstring(co, "f");
+    lua_gettable(co, -2);
 
-    lua_pushstring(l, "u");
-    lua_gettable(l, -3);
+    lua_pushstring(co, "u");
+    lua_gettable(co, -3);
 
-    int head_type = lua_type(l, -2);
+    int head_type = lua_type(co, -2);
+    if (head_type == LUA_TNIL){
+        // Tasks without a run callback are aliases for their dependencies
+        lua_settop(co, 0);
+        return LUA_OK;
+    }
     if (head_type != LUA_TFUNCTION){
-        fprintf(stderr, "Expected function for entry in _X for %s, got %s\n", this->target_name.c_str(), lua_typename(l, head_type));
+        fprintf(stderr, "Expected function for entry in _X for %s, got %s\n", this->target_name.c_str(), lua_typename(co, head_type));
         return LUA_ERRRUN;
     }
+    // Only leave the function and its argument on the thread
+    lua_remove(co, 1);
+    lua_remove(co, 1);
+
+    return this->resume(1);
+}
 
-    int status = lua_pcall(l, 1, 0, 0);
-    if (status == LUA_ERRRUN){
-        const char* error_msg = luaL_checkstring(l, -1);
-        luaL_error(l, "Unable to run function for build target %s: %s\n", this->target_name.c_str(), error_msg);
-    } else if (status != LUA_OK){
-        const char* error_msg = luaL_checkstring(l, -1);
-        fprintf(stderr, "Unable to run build target %s: %s\n", this->target_name.c_str(), error_msg);
+int BuildTarget::resume(int nargs){
+    int status = lua_resume(this->thread, NULL, nargs);
+    if (status != LUA_OK && status != LUA_YIELD){
+        const char* error_msg = lua_tostring(this->thread, -1);
+        fprintf(stderr, "Unable to run function for build target %s: %s\n", this->target_name.c_str(), error_msg != NULL ? error_msg : "unknown error");
     }
 
     return status;
 }
 
+void BuildTarget::release(lua_State* l){
+    if (this->thread_ref != LUA_NOREF){
+        lua_unref(l, this->thread_ref);
+    }
+    this->thread = NULL;
+    this->thread_ref = LUA_NOREF;
+}
+
 int BuildTarget::add_dependency(std::string target_name){
     std::shared_ptr<BuildTarget> p = BuildTarget::get_target(target_name);
 
     if (p != NULL){
+        // Repeated dependsOn calls, e.g. from a callback that runs in every pass, only add the edge once
+        for (auto& dep : this->dependencies){
+            if (dep == p){
+                return 0;
+            }
+        }
         // Explore the other target's dependencies to see if this is already in it
         if (has_circular_dependency(BuildTarget::get_target(this->target_name), p)){
             char buffer[1024];
@@ -133,3 +171,47 @@ int BuildTarget::add_dependency(std::string target_name){
     return 0;
 }
 
+
+std::string BuildTarget::get_name(){
+    return this->target_name;
+}
+
+const std::vector<std::shared_ptr<BuildTarget>>& BuildTarget::get_dependencies(){
+    return this->dependencies;
+}
+
+lua_State* BuildTarget::get_thread(){
+    return this->thread;
+}
+
+LBUILD_TARGET_STATE BuildTarget::get_state(){
+    return this->state;
+}
+
+void BuildTarget::set_state(LBUILD_TARGET_STATE state){
+    this->state = state;
+}
+
+int BuildTarget::get_weight(){
+    return this->weight;
+}
+
+void BuildTarget::set_weight(int weight){
+    this->weight = weight;
+}
+
+std::string BuildTarget::get_pool(){
+    return this->pool;
+}
+
+void BuildTarget::set_pool(std::string pool){
+    this->pool = pool;
+}
+
+bool BuildTarget::is_isolated(){
+    return this->isolated;
+}
+
+void BuildTarget::set_isolated(bool isolated){
+    this->isolated = isolated;
+}
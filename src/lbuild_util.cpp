@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <string>
@@ -11,10 +13,17 @@
 #include <exception>
 #include <memory>
 #include <map>
+#include <unordered_set>
+#include <mutex>
 #include <filesystem>
 
 #include "lbuild_util.h"
 #include "lbuild_target.h"
+#include "lbuild_scheduler.h"
+#include "lbuild_process.h"
+#include "lbuild_workers.h"
+#include "lbuild_stat.h"
+#include "lbuild_ninja.h"
 
 #include "lua.h"
 #include "lualib.h"
@@ -102,6 +111,47 @@ void LBUILD::lua_stackDump (lua_State *L) {
 }
 
 static unordered_map<string, unique_ptr<vector< string>>> depends_buffer;
+// Set once setup_dependencies has run, after which dependsOn adds its edges straight to the graph
+static bool graph_frozen = false;
+// Tasks created by a running callback, which lbuild.task hands back when the callback runs again in a later pass
+static unordered_set<string> runtime_tasks;
+
+/**
+ * Adds the edges of a dependsOn call made after the graph was set up, e.g. by a codegen task that creates tasks for
+ * the files it generated. Only the new edges are checked for cycles
+ */
+static void add_dependencies_now(lua_State* l, string task_name, const vector<string>& dependencies){
+    auto self = BuildTarget::get_target(task_name);
+    if (self == NULL){
+        luaL_error(l, "No task with name %s exists\n", task_name.c_str());
+        return;
+    }
+
+    Scheduler* scheduler = Scheduler::get_active();
+    if (scheduler != NULL && self->get_state() != LBUILD_TARGET_PENDING){
+        luaL_error(l, "Cannot add dependencies to task %s: it has already started\n", task_name.c_str());
+        return;
+    }
+
+    for (const string& dep_name : dependencies){
+        auto dep = BuildTarget::get_target(dep_name);
+        if (dep == NULL){
+            luaL_error(l, "Task %s cannot depend on %s: no task with that name exists\n", task_name.c_str(), dep_name.c_str());
+            return;
+        }
+
+        try {
+            self->add_dependency(dep_name);
+        } catch (const invalid_argument& e){
+            luaL_error(l, "Cannot add dependency: %s\n", e.what());
+            return;
+        }
+
+        if (scheduler != NULL){
+            scheduler->add_dependency(self, dep);
+        }
+    }
+}
 
 static int lbuild_task_dependsOn(lua_State* l){
     int argn = lua_gettop(l);
@@ -112,6 +162,15 @@ static int lbuild_task_dependsOn(lua_State* l){
         return 0;
     }
     struct lbuild_task_udata* self = (struct lbuild_task_udata*) lua_touserdata(l, 1);
+    if (WorkerPool::is_replica()){
+        // Worker replicas only need the callbacks, the graph is owned by the main state
+        if (WorkerPool::in_task(l)){
+            luaL_error(l, "Isolated task cannot add dependencies\n");
+            return 0;
+        }
+        lua_pushvalue(l, 1);
+        return 1;
+    }
     // The varargs are all the dependencies this task depends on
     unique_ptr<vector<string>> s = make_unique<vector<string>>();
     for (size_t i = 2; i <= argn; i++){
@@ -119,7 +178,9 @@ static int lbuild_task_dependsOn(lua_State* l){
         s->push_back(string(str));
     }
 
-    if (s->size() > 0){
+    if (graph_frozen){
+        add_dependencies_now(l, *self->task_name, *s);
+    } else if (s->size() > 0){
         // Defer setting all the dependencies until after we've set up all our builds
         depends_buffer.insert_or_assign(*self->task_name, move(s));
     }
@@ -160,19 +221,344 @@ static int lbuild_task_run(lua_State* l){
     return 1;
 }
 
+static int lbuild_task_weight(lua_State* l){
+    if (!lua_isuserdata(l, 1)){
+        luaL_error(l, "Invalid value for self parameter: Did you forget to use \":\" when calling weight?\n");
+        return 0;
+    }
+    struct lbuild_task_udata* self = (struct lbuild_task_udata*) lua_touserdata(l, 1);
+    int weight = luaL_checkinteger(l, 2);
+    if (weight < 1){
+        luaL_error(l, "Invalid weight %d for task %s: weight must be at least 1\n", weight, self->task_name->c_str());
+        return 0;
+    }
+    if (WorkerPool::is_replica()){
+        lua_pushvalue(l, 1);
+        return 1;
+    }
+
+    auto target = BuildTarget::get_target(*self->task_name);
+    if (target == NULL){
+        luaL_error(l, "No task with name %s exists\n", self->task_name->c_str());
+        return 0;
+    }
+    target->set_weight(weight);
+
+    // Push the userdata back to the top of the stack
+    lua_pushvalue(l, 1);
+    return 1;
+}
+
+static int lbuild_task_pool(lua_State* l){
+    if (!lua_isuserdata(l, 1)){
+        luaL_error(l, "Invalid value for self parameter: Did you forget to use \":\" when calling pool?\n");
+        return 0;
+    }
+    struct lbuild_task_udata* self = (struct lbuild_task_udata*) lua_touserdata(l, 1);
+    const char* pool_name = luaL_checkstring(l, 2);
+    if (WorkerPool::is_replica()){
+        lua_pushvalue(l, 1);
+        return 1;
+    }
+    if (!Scheduler::has_pool(string(pool_name))){
+        luaL_error(l, "Cannot assign task %s to pool %s: pool does not exist. Create it with lbuild.pool first\n", self->task_name->c_str(), pool_name);
+        return 0;
+    }
+
+    auto target = BuildTarget::get_target(*self->task_name);
+    if (target == NULL){
+        luaL_error(l, "No task with name %s exists\n", self->task_name->c_str());
+        return 0;
+    }
+    target->set_pool(string(pool_name));
+
+    // Push the userdata back to the top of the stack
+    lua_pushvalue(l, 1);
+    return 1;
+}
+
+static int lbuild_create_pool(lua_State* l){
+    const char* pool_name = luaL_checkstring(l, 1);
+    int capacity = luaL_checkinteger(l, 2);
+    if (capacity < 1){
+        luaL_error(l, "Invalid capacity %d for pool %s: capacity must be at least 1\n", capacity, pool_name);
+        return 0;
+    }
+    if (WorkerPool::is_replica()){
+        return 0;
+    }
+
+    try {
+        Scheduler::add_pool(string(pool_name), capacity);
+    } catch (const invalid_argument& e){
+        luaL_error(l, "Cannot create pool %s: pool already exists\n", pool_name);
+        return 0;
+    }
+
+    return 0;
+}
+
+static int lbuild_task_isolated(lua_State* l){
+    if (!lua_isuserdata(l, 1)){
+        luaL_error(l, "Invalid value for self parameter: Did you forget to use \":\" when calling isolated?\n");
+        return 0;
+    }
+    struct lbuild_task_udata* self = (struct lbuild_task_udata*) lua_touserdata(l, 1);
+    if (WorkerPool::is_replica()){
+        lua_pushvalue(l, 1);
+        return 1;
+    }
+
+    auto target = BuildTarget::get_target(*self->task_name);
+    if (target == NULL){
+        luaL_error(l, "No task with name %s exists\n", self->task_name->c_str());
+        return 0;
+    }
+    // Workers only know the callbacks the build script defines when it is evaluated
+    if (graph_frozen || Scheduler::get_active() != NULL){
+        luaL_error(l, "Task %s cannot be isolated: only tasks created while the build script is evaluated can run on workers\n", self->task_name->c_str());
+        return 0;
+    }
+    target->set_isolated(true);
+
+    // Push the userdata back to the top of the stack
+    lua_pushvalue(l, 1);
+    return 1;
+}
+
+/**
+ * A value stored with lbuild.setShared. Kept as plain C++ data since every worker has its own lua_State
+ */
+struct lbuild_shared_value {
+    int type;
+    string str;
+    double num;
+};
+
+static unordered_map<string, lbuild_shared_value> shared_values;
+static mutex shared_lock;
+
+static int lbuild_set_shared(lua_State* l){
+    const char* key = luaL_checkstring(l, 1);
+    int t = lua_type(l, 2);
+    // The main state already stored what the script sets while it is evaluated, a replica doing it again would overwrite values tasks set since
+    if (WorkerPool::is_replica() && !WorkerPool::in_task(l)){
+        return 0;
+    }
+
+    lbuild_shared_value value{t, "", 0};
+    switch (t){
+        case LUA_TSTRING:{
+            size_t len = 0;
+            const char* str = lua_tolstring(l, 2, &len);
+            value.str.assign(str, len);
+            break;
+        }
+
+        case LUA_TNUMBER:{
+            value.num = lua_tonumber(l, 2);
+            break;
+        }
+
+        case LUA_TBOOLEAN:{
+            value.num = lua_toboolean(l, 2);
+            break;
+        }
+
+        case LUA_TNIL:
+        case LUA_TNONE:{
+            lock_guard<mutex> guard(shared_lock);
+            shared_values.erase(key);
+            return 0;
+        }
+
+        default:{
+            luaL_error(l, "Expected string, number, boolean or nil for shared value %s, got %s\n", key, lua_typename(l, t));
+            return 0;
+        }
+    }
+
+    lock_guard<mutex> guard(shared_lock);
+    shared_values.insert_or_assign(string(key), move(value));
+
+    return 0;
+}
+
+static int lbuild_get_shared(lua_State* l){
+    const char* key = luaL_checkstring(l, 1);
+
+    lbuild_shared_value value{LUA_TNIL, "", 0};
+    {
+        lock_guard<mutex> guard(shared_lock);
+        auto it = shared_values.find(key);
+        if (it != shared_values.end()){
+            value = it->second;
+        }
+    }
+
+    switch (value.type){
+        case LUA_TSTRING:{
+            lua_pushlstring(l, value.str.data(), value.str.size());
+            break;
+        }
+
+        case LUA_TNUMBER:{
+            lua_pushnumber(l, value.num);
+            break;
+        }
+
+        case LUA_TBOOLEAN:{
+            lua_pushboolean(l, value.num != 0);
+            break;
+        }
+
+        default:{
+            lua_pushnil(l);
+            break;
+        }
+    }
+
+    return 1;
+}
+
+static void read_exec_list(lua_State* l, int options, const char* key, vector<string>& out){
+    lua_getfield(l, options, key);
+    if (!lua_isnil(l, -1)){
+        if (!lua_istable(l, -1)){
+            luaL_error(l, "Expected table for exec option %s, got %s\n", key, luaL_typename(l, -1));
+            return;
+        }
+
+        int len = lua_objlen(l, -1);
+        for (int i = 1; i <= len; i++){
+            lua_rawgeti(l, -1, i);
+            if (lua_type(l, -1) != LUA_TSTRING){
+                luaL_error(l, "Expected string for entry %d of exec option %s, got %s\n", i, key, luaL_typename(l, -1));
+                return;
+            }
+            out.push_back(lua_tostring(l, -1));
+            lua_pop(l, 1);
+        }
+    }
+    lua_pop(l, 1);
+}
+
+static string read_exec_string(lua_State* l, int options, const char* key){
+    string value;
+    lua_getfield(l, options, key);
+    if (!lua_isnil(l, -1)){
+        if (lua_type(l, -1) != LUA_TSTRING){
+            luaL_error(l, "Expected string for exec option %s, got %s\n", key, luaL_typename(l, -1));
+            return value;
+        }
+        value = lua_tostring(l, -1);
+    }
+    lua_pop(l, 1);
+
+    return value;
+}
+
+/**
+ * Reads the options table of lbuild.exec into the process spec
+ */
+static void read_exec_options(lua_State* l, int options, ProcessSpec& spec){
+    lua_getfield(l, options, "env");
+    if (!lua_isnil(l, -1)){
+        if (!lua_istable(l, -1)){
+            luaL_error(l, "Expected table for exec option env, got %s\n", luaL_typename(l, -1));
+            return;
+        }
+        // Sorted so the same env always produces the same process
+        map<string, string> env;
+        int env_index = lua_gettop(l);
+        lua_pushnil(l);
+        while (lua_next(l, env_index) != 0){
+            if (lua_type(l, -2) != LUA_TSTRING || lua_type(l, -1) != LUA_TSTRING){
+                luaL_error(l, "Expected string keys and values for exec option env\n");
+                return;
+            }
+            env.insert_or_assign(lua_tostring(l, -2), lua_tostring(l, -1));
+            lua_pop(l, 1);
+        }
+
+        spec.replace_env = true;
+        for (auto &[k,v] : env){
+            spec.env.push_back(k + "=" + v);
+        }
+    }
+    lua_pop(l, 1);
+
+    spec.cwd = read_exec_string(l, options, "cwd");
+    spec.stdin_path = read_exec_string(l, options, "stdin");
+
+    lua_getfield(l, options, "sandbox");
+    spec.sandbox = lua_toboolean(l, -1);
+    lua_pop(l, 1);
+
+    read_exec_list(l, options, "inputs", spec.inputs);
+    read_exec_list(l, options, "outputs", spec.outputs);
+
+    lua_getfield(l, options, "responseFile");
+    if (!lua_isnil(l, -1)){
+        spec.response_file = lua_toboolean(l, -1) ? LBUILD_RSP_ON : LBUILD_RSP_OFF;
+    }
+    lua_pop(l, 1);
+}
+
+/**
+ * Appends every entry of the array at index to args in order, flattening nested arrays so flag lists can be passed as is
+ */
+static void flatten_argv(lua_State* l, int index, vector<string>& args, int depth){
+    if (depth > 16){
+        luaL_error(l, "Table passed to exec is nested too deeply\n");
+        return;
+    }
+    luaL_checkstack(l, 2, "flattening exec arguments");
+
+    int len = lua_objlen(l, index);
+    // Only the top level is reserved, reserving for every nested table would defeat the vector's geometric growth
+    if (depth == 0){
+        args.reserve(args.size() + len);
+    }
+    for (int i = 1; i <= len; i++){
+        lua_rawgeti(l, index, i);
+        int t = lua_type(l, -1);
+        switch (t){
+            case LUA_TSTRING:
+            case LUA_TNUMBER:{
+                size_t arg_len = 0;
+                const char* arg = lua_tolstring(l, -1, &arg_len);
+                args.emplace_back(arg, arg_len);
+                break;
+            }
+
+            case LUA_TTABLE:{
+                flatten_argv(l, lua_gettop(l), args, depth + 1);
+                break;
+            }
+
+            default:{
+                luaL_error(l, "Expected string, number or table for entry %d of exec arguments, got %s\n", i, lua_typename(l, t));
+                return;
+            }
+        }
+        lua_pop(l, 1);
+    }
+}
+
 static int lbuild_inst_exec(lua_State* l){
-    int t = lua_type(l, -2);
+    int t = lua_type(l, 1);
     if (t != LUA_TUSERDATA){
         luaL_error(l, "Invalid value for argument 1: Must provide task object\n");
         return 0;
     }
-    struct lbuild_task_udata* self = (struct lbuild_task_udata*) lua_touserdata(l, -2);
+    struct lbuild_task_udata* self = (struct lbuild_task_udata*) lua_touserdata(l, 1);
 
-    int arg_type = lua_type(l, -1);
+    int arg_type = lua_type(l, 2);
     vector<string> args;
     switch (arg_type){
         case LUA_TSTRING:{
-            const char* input_str = luaL_checkstring(l, -1);
+            const char* input_str = luaL_checkstring(l, 2);
             istringstream str_strm(input_str);
             string output;
             // Split the string by [^\s"']+|"([^"]*)"|'([^']*)' 
@@ -185,16 +571,8 @@ static int lbuild_inst_exec(lua_State* l){
         }
 
         case LUA_TTABLE:{
-            int t = lua_gettop(l);
-            lua_pushnil(l);
-            while (lua_next(l, t) != 0) {
-                // Thanks lua docs on lua_next for letting me blatantly pilfer this block
-                const char* exec_line = luaL_checkstring(l, -1);
-                args.push_back(exec_line);
-
-                lua_pop(l, 1);
-            }
-
+            // Tables go straight into the argv without being tokenized
+            flatten_argv(l, 2, args, 0);
             break;
         }
         
@@ -203,52 +581,76 @@ static int lbuild_inst_exec(lua_State* l){
             break;
         }
     }
-    vector<char*> as_chars;
-
-    transform(args.begin(), args.end(), back_inserter(as_chars), [](const string& s){
-        char* str = new char[s.size() + 1];
-        strcpy(str, s.c_str());
+    if (args.empty()){
+        luaL_error(l, "No command was given to exec for task %s\n", self->task_name->c_str());
+        return 0;
+    }
 
-        return str;
-    });
-    as_chars.push_back(NULL);
+    ProcessSpec spec;
+    spec.argv = move(args);
+    if (!lua_isnoneornil(l, 3)){
+        luaL_checktype(l, 3, LUA_TTABLE);
+        read_exec_options(l, 3, spec);
+    }
 
-    pid_t exec_process = fork();
-    if (exec_process < 0){
-        fprintf(stderr, "Unable to fork process\n");
-    } else if (exec_process > 0) {
-        // Parent process
-        int status = 0;
-        waitpid(exec_process, &status, 0);
-        //printf("%s completed\n", as_chars.at(0));
-    } else {
-        // Child process
-        bool first = true;
-        for (auto v : as_chars){
-            if (!first){
-                printf(" ");
-            } else {first = false;}
-            //printf("%s", v);
+    if (WorkerPool::is_replica()){
+        if (WorkerPool::in_task(l) && lua_isyieldable(l)){
+            WorkerPool::request_exec(move(spec));
+            return lua_yield(l, 0);
+        } else if (!WorkerPool::in_task(l)){
+            // The main state already ran the commands of the build script itself
+            lua_pushinteger(l, 0);
+            return 1;
         }
-        //printf("\n");
-        int res = execvp(as_chars.at(0), as_chars.data());
 
-        exit(res);
+        lua_pushinteger(l, run_process(spec));
+        return 1;
     }
 
-    for (size_t i = 0; i < (as_chars.size() - 1); i++){
-        delete as_chars.at(i);
+    // Inside a run callback hand the command to the scheduler and wait for it to finish
+    Scheduler* scheduler = Scheduler::get_active();
+    auto target = BuildTarget::get_target(*self->task_name);
+    if (scheduler != NULL && target != NULL && target->get_thread() == l && lua_isyieldable(l)){
+        scheduler->submit_job(target, move(spec));
+        return lua_yield(l, 0);
+    }
+    if (NinjaWriter::is_recording() && scheduler != NULL && target != NULL){
+        NinjaWriter::record_command(target->get_name(), spec);
+        lua_pushinteger(l, 0);
+        return 1;
     }
+
+    lua_pushinteger(l, run_process(spec));
+    return 1;
 }
 
 static int lbuild_create_lua_obj(lua_State* l){
     const char* task_name = luaL_checkstring(l, 1);
-    // Create the lbuild_target object
-    try {
-        BuildTarget::create_target(string(task_name));
-    } catch (invalid_argument e){
-        luaL_error(l, "Cannot create build target %s: target already exists\n", task_name);
-        return 0;
+    // Create the lbuild_target object, worker replicas only need the callback in _X
+    if (WorkerPool::is_replica()){
+        if (WorkerPool::in_task(l)){
+            luaL_error(l, "Cannot create build target %s from an isolated task\n", task_name);
+            return 0;
+        }
+    } else if (Scheduler::get_active() != NULL && runtime_tasks.count(task_name) > 0){
+        // Callbacks that create tasks run again in every pass, so hand back the task the last pass created
+        lua_getglobal(l, "_X");
+        lua_pushstring(l, task_name);
+        lua_gettable(l, -2);
+        lua_pushstring(l, "u");
+        lua_gettable(l, -2);
+
+        return 1;
+    } else {
+        try {
+            BuildTarget::create_target(string(task_name));
+        } catch (invalid_argument e){
+            luaL_error(l, "Cannot create build target %s: target already exists\n", task_name);
+            return 0;
+        }
+        if (Scheduler::get_active() != NULL){
+            runtime_tasks.insert(task_name);
+        }
     }
     // Allocate userdata purely to hold onto the task name
     size_t len = strlen(task_name);
@@ -280,12 +682,37 @@ static int lbuild_create_lua_obj(lua_State* l){
     return 1;
 }
 
+static int lbuild_get_task(lua_State* l){
+    const char* task_name = luaL_checkstring(l, 1);
+
+    lua_getglobal(l, "_X");
+    lua_pushstring(l, task_name);
+    lua_gettable(l, -2);
+    if (lua_isnil(l, -1)){
+        return 1;
+    }
+
+    lua_pushstring(l, "u");
+    lua_gettable(l, -2);
+
+    return 1;
+}
+
 static int lbuild_run_task(lua_State* l){
     if (!lua_isuserdata(l, 1)){
         luaL_error(l, "Invalid value for self parameter: Did you forget to use \":\" when calling run?\n");
         return 0;
     }
     struct lbuild_task_udata* self = (struct lbuild_task_udata*) lua_touserdata(l, 1);
+    if (WorkerPool::is_replica()){
+        if (WorkerPool::in_task(l)){
+            luaL_error(l, "runTask cannot be called from isolated task %s\n", self->task_name->c_str());
+            return 0;
+        }
+        // The main state already ran the tasks of the build script itself
+        lua_pushboolean(l, true);
+        return 1;
+    }
     auto self_obj = BuildTarget::get_target(*(self->task_name));
     if (self_obj == NULL){
         luaL_error(l, "No task with name %s exists\n", self->task_name->c_str());
@@ -311,7 +738,270 @@ static int lbuild_run_task(lua_State* l){
         return 0;
     }
 
-    task->run(l);
+    Scheduler* scheduler = Scheduler::get_active();
+    if (scheduler == NULL){
+        // Called while the build script is being evaluated so run a pass of its own
+        Scheduler task_pass(l);
+        lua_pushboolean(l, task_pass.run({task}) == LUA_OK);
+        return 1;
+    }
+
+    if (self_obj->get_thread() != l || !lua_isyieldable(l)){
+        luaL_error(l, "runTask must be called directly from the run callback of task %s\n", self->task_name->c_str());
+        return 0;
+    }
+
+    LBUILD_TARGET_STATE state;
+    try {
+        state = scheduler->wait_target(self_obj, task);
+    } catch (const invalid_argument& e){
+        luaL_error(l, "Cannot run task %s: %s\n", target_task, e.what());
+        return 0;
+    }
+    if (state == LBUILD_TARGET_DONE || state == LBUILD_TARGET_FAILED){
+        lua_pushboolean(l, state == LBUILD_TARGET_DONE);
+        return 1;
+    }
+
+    return lua_yield(l, 0);
+}
+
+static int lbuild_join(lua_State* l){
+    luaL_checktype(l, 1, LUA_TTABLE);
+    size_t sep_len = 0;
+    const char* sep = luaL_optlstring(l, 2, " ", &sep_len);
+
+    // Measure everything first so the result is only allocated once
+    int len = lua_objlen(l, 1);
+    size_t total = 0;
+    for (int i = 1; i <= len; i++){
+        lua_rawgeti(l, 1, i);
+        int t = lua_type(l, -1);
+        if (t != LUA_TSTRING && t != LUA_TNUMBER){
+            luaL_error(l, "Expected string or number for entry %d of join, got %s\n", i, lua_typename(l, t));
+            return 0;
+        }
+        size_t entry_len = 0;
+        lua_tolstring(l, -1, &entry_len);
+        total += entry_len;
+        lua_pop(l, 1);
+    }
+    if (len > 1){
+        total += sep_len * (len - 1);
+    }
+
+    luaL_Strbuf buffer;
+    char* out = luaL_buffinitsize(l, &buffer, total);
+    for (int i = 1; i <= len; i++){
+        if (i > 1){
+            memcpy(out, sep, sep_len);
+            out += sep_len;
+        }
+
+        lua_rawgeti(l, 1, i);
+        size_t entry_len = 0;
+        const char* entry = lua_tolstring(l, -1, &entry_len);
+        memcpy(out, entry, entry_len);
+        out += entry_len;
+        lua_pop(l, 1);
+    }
+    luaL_pushresultsize(&buffer, total);
+
+    return 1;
+}
+
+/**
+ * Pushes a, b and c joined together as one string, allocating it once
+ */
+static void push_concat3(lua_State* l, const char* a, size_t a_len, const char* b, size_t b_len, const char* c, size_t c_len){
+    size_t total = a_len + b_len + c_len;
+
+    luaL_Strbuf buffer;
+    char* out = luaL_buffinitsize(l, &buffer, total);
+    memcpy(out, a, a_len);
+    memcpy(out + a_len, b, b_len);
+    memcpy(out + a_len + b_len, c, c_len);
+    luaL_pushresultsize(&buffer, total);
+}
+
+/**
+ * Returns the offset of the file name in path
+ */
+static size_t basename_offset(const char* path, size_t len){
+    for (size_t i = len; i > 0; i--){
+        if (path[i - 1] == '/'){return i;}
+    }
+    return 0;
+}
+
+typedef void (*lbuild_path_transform)(lua_State* l, const char* path, size_t len, const char* arg, size_t arg_len);
+
+static void transform_prefix(lua_State* l, const char* path, size_t len, const char* arg, size_t arg_len){
+    push_concat3(l, arg, arg_len, path, len, "", 0);
+}
+
+static void transform_extension(lua_State* l, const char* path, size_t len, const char* arg, size_t arg_len){
+    size_t name = basename_offset(path, len);
+    size_t stem_len = len;
+    // A leading dot is part of the name (e.g. .gitignore) rather than an extension
+    for (size_t i = len; i > name + 1; i--){
+        if (path[i - 1] == '.'){
+            stem_len = i - 1;
+            break;
+        }
+    }
+
+    bool needs_dot = arg_len > 0 && arg[0] != '.';
+    push_concat3(l, path, stem_len, ".", needs_dot ? 1 : 0, arg, arg_len);
+}
+
+static void transform_dir(lua_State* l, const char* path, size_t len, const char* arg, size_t arg_len){
+    size_t name = basename_offset(path, len);
+    bool needs_slash = arg_len > 0 && arg[arg_len - 1] != '/';
+    push_concat3(l, arg, arg_len, "/", needs_slash ? 1 : 0, path + name, len - name);
+}
+
+/**
+ * Applies transform to a single path or every path in a list, returning a value of the same shape
+ */
+static int map_paths(lua_State* l, lbuild_path_transform transform){
+    size_t arg_len = 0;
+    const char* arg = luaL_checklstring(l, 2, &arg_len);
+
+    if (lua_type(l, 1) == LUA_TSTRING){
+        size_t len = 0;
+        const char* path = lua_tolstring(l, 1, &len);
+        transform(l, path, len, arg, arg_len);
+        return 1;
+    }
+    luaL_checktype(l, 1, LUA_TTABLE);
+
+    int len = lua_objlen(l, 1);
+    lua_createtable(l, len, 0);
+    int out = lua_gettop(l);
+    for (int i = 1; i <= len; i++){
+        lua_rawgeti(l, 1, i);
+        if (lua_type(l, -1) != LUA_TSTRING){
+            luaL_error(l, "Expected string for entry %d of paths, got %s\n", i, luaL_typename(l, -1));
+            return 0;
+        }
+        size_t path_len = 0;
+        const char* path = lua_tolstring(l, -1, &path_len);
+        transform(l, path, path_len, arg, arg_len);
+        lua_rawseti(l, out, i);
+        lua_pop(l, 1);
+    }
+
+    return 1;
+}
+
+static int lbuild_prefix(lua_State* l){
+    return map_paths(l, transform_prefix);
+}
+
+static int lbuild_replace_extension(lua_State* l){
+    return map_paths(l, transform_extension);
+}
+
+static int lbuild_change_dir(lua_State* l){
+    return map_paths(l, transform_dir);
+}
+
+/**
+ * Appends the path or list of paths at index to out
+ */
+static void read_path_list(lua_State* l, int index, vector<string>& out){
+    if (lua_type(l, index) == LUA_TSTRING){
+        out.push_back(lua_tostring(l, index));
+        return;
+    }
+    luaL_checktype(l, index, LUA_TTABLE);
+
+    int len = lua_objlen(l, index);
+    out.reserve(out.size() + len);
+    for (int i = 1; i <= len; i++){
+        lua_rawgeti(l, index, i);
+        if (lua_type(l, -1) != LUA_TSTRING){
+            luaL_error(l, "Expected string for entry %d of paths, got %s\n", i, luaL_typename(l, -1));
+            return;
+        }
+        out.push_back(lua_tostring(l, -1));
+        lua_pop(l, 1);
+    }
+}
+
+/**
+ * Returns true if any output is missing or older than the newest input
+ */
+static int lbuild_is_stale(lua_State* l){
+    vector<string> outputs;
+    vector<string> inputs;
+    read_path_list(l, 1, outputs);
+    read_path_list(l, 2, inputs);
+
+    // Everything has to run while recording so all commands end up in the ninja file, which checks freshness itself
+    if (NinjaWriter::is_recording()){
+        lua_pushboolean(l, true);
+        return 1;
+    }
+
+    vector<string> all(outputs);
+    all.insert(all.end(), inputs.begin(), inputs.end());
+    vector<uint32_t> ids = StatCache::prefetch(all);
+
+    bool stale = outputs.empty();
+    int64_t oldest_output = INT64_MAX;
+    for (size_t i = 0; i < outputs.size(); i++){
+        FileStat st = StatCache::get(ids.at(i));
+        if (!st.exists){
+            stale = true;
+            break;
+        }
+        oldest_output = min(oldest_output, st.mtime_ns);
+    }
+
+    // Missing inputs count as stale so the command runs and reports them
+    for (size_t i = 0; i < inputs.size() && !stale; i++){
+        FileStat st = StatCache::get(ids.at(outputs.size() + i));
+        stale = !st.exists || st.mtime_ns > oldest_output;
+    }
+
+    lua_pushboolean(l, stale);
+    return 1;
+}
+
+static int lbuild_mtime(lua_State* l){
+    FileStat st = StatCache::get(luaL_checkstring(l, 1));
+    if (!st.exists){
+        lua_pushnil(l);
+    } else {
+        lua_pushnumber(l, st.mtime_ns / 1e9);
+    }
+
+    return 1;
+}
+
+static int lbuild_prefetch(lua_State* l){
+    vector<string> paths;
+    read_path_list(l, 1, paths);
+    StatCache::prefetch(paths);
+
+    return 0;
+}
+
+static int lbuild_invalidate(lua_State* l){
+    if (lua_isnoneornil(l, 1)){
+        StatCache::invalidate_all();
+        return 0;
+    }
+
+    vector<string> paths;
+    read_path_list(l, 1, paths);
+    for (const string& path : paths){
+        StatCache::invalidate(path);
+    }
+
+    return 0;
 }
 
 static int lbuild_get_files(lua_State* l){
@@ -320,6 +1010,7 @@ static int lbuild_get_files(lua_State* l){
     size_t t = lua_gettop(l);
 
     int index = 1;
+    vector<string> found;
     for (size_t i = 1; i < t; i++){
         const char* dir = luaL_checkstring(l, i);
         filesystem::path file_path(dir);
@@ -349,12 +1040,16 @@ static int lbuild_get_files(lua_State* l){
             lua_pushstring(l, "path");
             lua_pushstring(l, path.c_str());
             lua_settable(l, -3);
+            found.push_back(move(path));
 
             //printf("file: %s%s, path: %s\n", file_name.c_str(), ext.c_str(), child_path.relative_path().c_str());
 
             index += 1;
         }
     }
+    // Listed files are usually checked with lbuild.isStale next, so stat them all at once while we're here
+    StatCache::prefetch(found);
+
     // Put the main table back onto the top of the stack
     lua_pushvalue(l, t); // This is the value immediately after all the arguments
 
@@ -364,14 +1059,29 @@ static int lbuild_get_files(lua_State* l){
 static const luaL_Reg lbuild_task_methods[] = {
     {"dependsOn", lbuild_task_dependsOn},
     {"run", lbuild_task_run},
+    {"weight", lbuild_task_weight},
+    {"pool", lbuild_task_pool},
+    {"isolated", lbuild_task_isolated},
     {NULL, NULL}
 };
 
 static const luaL_Reg lbuild_lib[] = {
     {"task", lbuild_create_lua_obj},
+    {"getTask", lbuild_get_task},
     {"getFiles", lbuild_get_files},
     {"exec", lbuild_inst_exec},
     {"runTask", lbuild_run_task},
+    {"pool", lbuild_create_pool},
+    {"setShared", lbuild_set_shared},
+    {"getShared", lbuild_get_shared},
+    {"join", lbuild_join},
+    {"prefix", lbuild_prefix},
+    {"replaceExtension", lbuild_replace_extension},
+    {"changeDir", lbuild_change_dir},
+    {"isStale", lbuild_is_stale},
+    {"mtime", lbuild_mtime},
+    {"prefetch", lbuild_prefetch},
+    {"invalidate", lbuild_invalidate},
     {NULL, NULL}
 };
 
@@ -423,9 +1133,11 @@ void LBUILD::setup_dependencies(){
         }
         //printf("\n");
     }
+
+    graph_frozen = true;
 }
 
-void LBUILD::run_task(lua_State* l, string task_name){
+int LBUILD::run_task(lua_State* l, string task_name){
     shared_ptr<BuildTarget> p = BuildTarget::get_target(task_name);
     if (p == NULL){
         char buffer[1024];
@@ -433,9 +1145,28 @@ void LBUILD::run_task(lua_State* l, string task_name){
         throw invalid_argument(buffer);
     }
 
-    p->run(l);
+    Scheduler scheduler(l);
+    return scheduler.run({p});
+}
+
+void LBUILD::reset_script(){
+    depends_buffer.clear();
+    graph_frozen = false;
+    runtime_tasks.clear();
+    BuildTarget::cleanup();
+    Scheduler::cleanup();
+
+    lock_guard<mutex> guard(shared_lock);
+    shared_values.clear();
 }
 
 void LBUILD::cleanup(){
     depends_buffer.clear();
+    graph_frozen = false;
+    runtime_tasks.clear();
+    Scheduler::cleanup();
+    WorkerPool::cleanup();
+    cleanup_processes();
+    StatCache::cleanup();
+    NinjaWriter::cleanup();
 }
@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+
+#include "lbuild_workers.h"
+#include "lbuild_util.h"
+#include "luau_executor.h"
+
+#include "lua.h"
+#include "lualib.h"
+
+using namespace LBUILD;
+using namespace std;
+
+/**
+ * State of the task callback a worker is currently running
+ */
+struct WorkerContext {
+    lua_State* thread;
+    bool has_exec;
+    ProcessSpec spec;
+};
+
+static vector<thread> workers;
+static mutex worker_lock;
+static condition_variable work_ready;
+static deque<shared_ptr<BuildTarget>> work;
+static vector<WorkerMessage> outbox;
+static int event_fd = -1;
+static bool stopping = false;
+static int worker_count = 0;
+
+static thread_local bool replica = false;
+static thread_local WorkerContext* context = NULL;
+
+static void post(WorkerMessage msg){
+    {
+        lock_guard<mutex> guard(worker_lock);
+        outbox.push_back(move(msg));
+    }
+
+    uint64_t one = 1;
+    if (write(event_fd, &one, sizeof(one)) < 0){
+        perror("Unable to notify the scheduler");
+    }
+}
+
+/**
+ * Runs the callback of target in this worker's state, forwarding every lbuild.exec to the scheduler
+ */
+static int run_isolated(lua_State* l, shared_ptr<BuildTarget> target, string& error){
+    string target_name = target->get_name();
+    lua_State* co = lua_newthread(l);
+    int thread_ref = lua_ref(l, -1);
+    lua_pop(l, 1);
+
+    // Fetch the lua function associated with this build rule from the replica's _X
+    lua_getglobal(co, "_X");
+    lua_pushstring(co, target_name.c_str());
+    lua_gettable(co, -2);
+    if (lua_isnil(co, -1)){
+        error = "No lua function is registered in _X for build target " + target_name;
+        lua_unref(l, thread_ref);
+        return LUA_ERRRUN;
+    }
+
+    lua_pushstring(co, "f");
+    lua_gettable(co, -2);
+
+    lua_pushstring(co, "u");
+    lua_gettable(co, -3);
+
+    if (lua_type(co, -2) == LUA_TNIL){
+        // Tasks without a run callback are aliases for their dependencies
+        lua_unref(l, thread_ref);
+        return LUA_OK;
+    }
+    if (lua_type(co, -2) != LUA_TFUNCTION){
+        error = string("Expected function for entry in _X for ") + target_name + ", got " + lua_typename(co, lua_type(co, -2));
+        lua_unref(l, thread_ref);
+        return LUA_ERRRUN;
+    }
+    lua_remove(co, 1);
+    lua_remove(co, 1);
+
+    WorkerContext task_context{co, false, {}};
+    context = &task_context;
+
+    int status = lua_resume(co, NULL, 1);
+    while (status == LUA_YIELD){
+        if (!task_context.has_exec){
+            error = "Task " + target_name + " yielded outside of lbuild.exec";
+            status = LUA_ERRRUN;
+            break;
+        }
+        task_context.has_exec = false;
+
+        auto result = make_shared<promise<int>>();
+        future<int> exit_code = result->get_future();
+        post({LBUILD_WORKER_EXEC, target, move(task_context.spec), result, 0, ""});
+        task_context.spec = ProcessSpec();
+
+        lua_pushinteger(co, exit_code.get());
+        status = lua_resume(co, NULL, 1);
+    }
+
+    if (status != LUA_OK && error.empty()){
+        const char* error_msg = lua_tostring(co, -1);
+        error = error_msg != NULL ? error_msg : "unknown error";
+    }
+
+    context = NULL;
+    lua_unref(l, thread_ref);
+
+    return status;
+}
+
+static void worker_main(){
+    replica = true;
+
+    lua_State* l = luaL_newstate();
+    lua_setsafeenv(l, LUA_ENVIRONINDEX, 1);
+    luaL_openlibs(l);
+    LBUILD::init_lua(l);
+
+    // Evaluate the build script again from the bytecode main already compiled
+    string script_error = "";
+    int script_status = luau_exec::luau_dobytecode(l, "lbuild.lua", luau_exec::luau_get_bytecode());
+    if (script_status != LUA_OK){
+        const char* err = lua_tostring(l, -1);
+        script_error = err != NULL ? err : "unknown error";
+    }
+    lua_settop(l, 0);
+
+    while (true){
+        shared_ptr<BuildTarget> target;
+        {
+            unique_lock<mutex> guard(worker_lock);
+            work_ready.wait(guard, []{return stopping || !work.empty();});
+            if (stopping){break;}
+
+            target = work.front();
+            work.pop_front();
+        }
+
+        WorkerMessage done{LBUILD_WORKER_DONE, target, {}, NULL, LUA_ERRRUN, ""};
+        if (script_status != LUA_OK){
+            done.error = "The build script failed to load on a worker: " + script_error;
+        } else {
+            done.status = run_isolated(l, target, done.error);
+        }
+        post(move(done));
+    }
+
+    lua_close(l);
+}
+
+void WorkerPool::set_worker_count(int count){
+    worker_count = count;
+}
+
+int WorkerPool::get_worker_count(){
+    return worker_count;
+}
+
+bool WorkerPool::enabled(){
+    return worker_count > 0;
+}
+
+void WorkerPool::dispatch(shared_ptr<BuildTarget> target){
+    if (workers.empty()){
+        event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        stopping = false;
+        for (int i = 0; i < worker_count; i++){
+            workers.emplace_back(worker_main);
+        }
+    }
+
+    {
+        lock_guard<mutex> guard(worker_lock);
+        work.push_back(target);
+    }
+    work_ready.notify_one();
+}
+
+int WorkerPool::get_event_fd(){
+    return event_fd;
+}
+
+vector<WorkerMessage> WorkerPool::drain(){
+    uint64_t count = 0;
+    if (event_fd >= 0 && read(event_fd, &count, sizeof(count)) < 0){
+        // Nothing has been posted since the last drain
+        count = 0;
+    }
+
+    vector<WorkerMessage> messages;
+    lock_guard<mutex> guard(worker_lock);
+    messages.swap(outbox);
+
+    return messages;
+}
+
+bool WorkerPool::is_replica(){
+    return replica;
+}
+
+bool WorkerPool::in_task(lua_State* l){
+    return context != NULL && context->thread == l;
+}
+
+void WorkerPool::request_exec(ProcessSpec spec){
+    context->spec = move(spec);
+    context->has_exec = true;
+}
+
+void WorkerPool::cleanup(){
+    {
+        lock_guard<mutex> guard(worker_lock);
+        stopping = true;
+    }
+    work_ready.notify_all();
+
+    for (thread& worker : workers){
+        worker.join();
+    }
+    workers.clear();
+    work.clear();
+    outbox.clear();
+
+    if (event_fd >= 0){
+        close(event_fd);
+        event_fd = -1;
+    }
+}
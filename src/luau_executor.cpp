@@ -12,6 +12,18 @@
 
 using namespace std;
 
+static string cached_bytecode = "";
+
+int luau_exec::luau_dobytecode(lua_State* L, const char* chunk_name, const string& bytecode){
+    return 
+        luau_load(L, chunk_name, bytecode.data(), bytecode.size(), 0) ||
+        lua_pcall(L, 0, LUA_MULTRET, 0);
+}
+
+const string& luau_exec::luau_get_bytecode(){
+    return cached_bytecode;
+}
+
 int luau_exec::luau_dofile(lua_State* L, char* src_dir){
     // Manipulate the file a bit too
     filesystem::path filePath = src_dir;
@@ -50,10 +62,10 @@ int luau_exec::luau_dofile(lua_State* L, char* src_dir){
     //for (size_t i = 0; i < bytecode_len; i++){
     //    printf("0x%.2x\n", bytecode[i]);
     //}
+    // Keep the bytecode around so worker states can load the script without compiling it again
+    cached_bytecode.assign(bytecode, bytecode_len);
 
-    int ret_val = 
-        luau_load(L, filePath.filename().c_str(), bytecode, bytecode_len, 0) ||
-        lua_pcall(L, 0, LUA_MULTRET, 0);
+    int ret_val = luau_exec::luau_dobytecode(L, filePath.filename().c_str(), cached_bytecode);
 
     free(bytecode);
     free(file_buff);
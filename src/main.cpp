@@ -7,11 +7,17 @@
 #include <exception>
 #include <memory>
 #include <filesystem>
+#include <string>
+#include <vector>
+#include <set>
 
 #include "main.h"
 #include "luau_executor.h"
 #include "lbuild_util.h"
 #include "lbuild_target.h"
+#include "lbuild_scheduler.h"
+#include "lbuild_workers.h"
+#include "lbuild_ninja.h"
 
 #include "lua.h"
 #include "luacode.h"
@@ -19,7 +25,14 @@
 
 using namespace std;
 
-int main (int argn, char** argv) {
+static void print_usage(){
+    fprintf(stderr, "usage: lbuild [-j jobs] [--memory-pressure percent] [--lua-workers count] task...\n       lbuild --emit-ninja\n");
+}
+
+/**
+ * Creates a lua state and evaluates the build script in it, reusing the bytecode of the first evaluation after that
+ */
+static lua_State* load_build_script(const char* build_file, bool from_bytecode){
     lua_State* l = luaL_newstate();
 
     lua_setsafeenv(l, LUA_ENVIRONINDEX, 1);
@@ -34,15 +47,13 @@ int main (int argn, char** argv) {
 
     // Finalise the lua state
     //luaL_sandbox(l);
-    
-    filesystem::path build_path("./lbuild.lua");
-    if (!filesystem::exists(build_path)){
-        fprintf(stderr, "[lbuild error] Unable to find \"%s\" in \"%s\"\n", build_path.filename().c_str(),build_path.parent_path().c_str());
-        exit(1);
+
+    int status;
+    if (from_bytecode){
+        status = luau_exec::luau_dobytecode(l, build_file, luau_exec::luau_get_bytecode());
+    } else {
+        status = luau_exec::luau_dofile(l, (char*) build_file);
     }
-    
-    const char* build_file = build_path.c_str();
-    int status = luau_exec::luau_dofile(l, (char*) build_file);
 
     if (status != LUA_OK){
         const char* err = lua_tostring(l, -1);
@@ -54,14 +65,118 @@ int main (int argn, char** argv) {
     // Setup the dependencies
     LBUILD::setup_dependencies();
 
-    //printf("argn: %d\n", argn);
-    if (argn > 1){
-        for (int i = 1; i < argn; i++){
-            try{
-                LBUILD::run_task(l, argv[i]);
-            } catch (std::invalid_argument e){
-                fprintf(stderr, "%s is not a valid job\n", argv[i]);
+    return l;
+}
+
+/**
+ * Records every root task in a dry run pass over a freshly evaluated build script and writes build.ninja
+ *
+ * Separate states keep lua state changed by one root's tasks (like debug adding flags) out of the commands of others
+ */
+static bool emit_ninja_file(lua_State*& l, const filesystem::path& build_path){
+    set<string> has_dependents;
+    for (auto &[k,v] : LBUILD::BuildTarget::registered_targets){
+        for (auto dep : v->get_dependencies()){
+            has_dependents.insert(dep->get_name());
+        }
+    }
+    // Sorted so the same script always records its passes in the same order
+    set<string> roots;
+    for (auto &[k,v] : LBUILD::BuildTarget::registered_targets){
+        if (has_dependents.count(k) == 0){
+            roots.insert(k);
+        }
+    }
+
+    bool first = true;
+    for (const string& root : roots){
+        if (!first){
+            lua_close(l);
+            LBUILD::reset_script();
+            l = load_build_script(build_path.c_str(), true);
+        }
+        first = false;
+
+        auto target = LBUILD::BuildTarget::get_target(root);
+        if (target == NULL){
+            fprintf(stderr, "[lbuild error] Task %s was not created when the build script was evaluated again\n", root.c_str());
+            return false;
+        }
+
+        LBUILD::NinjaWriter::begin_pass(root);
+        LBUILD::Scheduler scheduler(l);
+        if (scheduler.run({target}) != LUA_OK || !LBUILD::NinjaWriter::end_pass()){
+            return false;
+        }
+    }
+
+    return LBUILD::NinjaWriter::write("build.ninja", build_path.filename());
+}
+
+int main (int argn, char** argv) {
+    // Options have to be parsed before the build script runs since it may already run tasks
+    vector<string> tasks;
+    bool emit_ninja = false;
+    for (int i = 1; i < argn; i++){
+        string arg(argv[i]);
+        if (arg.rfind("-j", 0) == 0){
+            string value = arg.substr(2);
+            if (value.empty() && i + 1 < argn){
+                value = argv[++i];
+            }
+            int jobs = atoi(value.c_str());
+            if (jobs < 1){
+                fprintf(stderr, "[lbuild error] Invalid job count \"%s\"\n", value.c_str());
+                exit(1);
+            }
+            LBUILD::Scheduler::set_jobs(jobs);
+        } else if (arg == "--memory-pressure" && i + 1 < argn){
+            LBUILD::Scheduler::set_memory_pressure_limit(atof(argv[++i]));
+        } else if (arg == "--lua-workers" && i + 1 < argn){
+            LBUILD::WorkerPool::set_worker_count(atoi(argv[++i]));
+        } else if (arg == "--emit-ninja"){
+            emit_ninja = true;
+        } else if (arg.rfind("-", 0) == 0){
+            fprintf(stderr, "[lbuild error] Unknown option \"%s\"\n", arg.c_str());
+            print_usage();
+            exit(1);
+        } else {
+            tasks.push_back(arg);
+        }
+    }
+    if (emit_ninja && !tasks.empty()){
+        fprintf(stderr, "[lbuild error] --emit-ninja writes every task and can't be given tasks to run\n");
+        print_usage();
+        exit(1);
+    }
+    if (emit_ninja){
+        // Set before the build script runs so its freshness checks already see it
+        LBUILD::NinjaWriter::start_recording();
+        // Worker replicas keep their lua state between passes, so isolated tasks run on the main state instead
+        LBUILD::WorkerPool::set_worker_count(0);
+    }
+
+    filesystem::path build_path("./lbuild.lua");
+    if (!filesystem::exists(build_path)){
+        fprintf(stderr, "[lbuild error] Unable to find \"%s\" in \"%s\"\n", build_path.filename().c_str(),build_path.parent_path().c_str());
+        exit(1);
+    }
+    
+    lua_State* l = load_build_script(build_path.c_str(), false);
+
+    int exit_status = 0;
+    if (emit_ninja && !emit_ninja_file(l, build_path)){
+        exit_status = 1;
+    }
+    for (string task : tasks){
+        try{
+            if (LBUILD::run_task(l, task) != LUA_OK){
+                exit_status = 1;
+                break;
             }
+        } catch (std::invalid_argument e){
+            fprintf(stderr, "%s is not a valid job\n", task.c_str());
+            exit_status = 1;
         }
     }
 
@@ -69,6 +184,7 @@ int main (int argn, char** argv) {
 
     // Cleanup
     LBUILD::BuildTarget::cleanup();
+    LBUILD::cleanup();
     lua_close(l);
-    return 0;
+    return exit_status;
 }